@@ -0,0 +1,762 @@
+;; A small, typed subset of Scheme that compiles to OpenCL C.
+;;
+;; The file uses the procedures of the extension, so it is loaded
+;; after it:
+;;
+;; (load-extension "./clops" "init")
+;; (load "clops-kernel.scm")
+;;
+;; (define-cl-kernel (saxpy (y (global float)) (x (global float)) a n)
+;;   (let ((i (get-global-id 0)))
+;;     (when (< i n)
+;;       (set! (ref y i) (+ (* a (ref x i)) (ref y i))))))
+;;
+;; defines saxpy as a kernel specification, whose source can be built
+;; with (cl-make-kernel saxpy device) and whose arguments are bound
+;; with (cl-bind-kernel-arguments saxpy kernel y-buffer x-buffer 2.0 n).
+;; The types of the parameters that weren't declared (a and n above)
+;; are inferred from their use, so that the scalars are passed
+;; to the kernel with the right size.
+;;
+;; If the name is given as (name constant ...), then name becomes
+;; a procedure that takes the values of the constants and returns
+;; a kernel specialized for them: the constants are substituted into
+;; the body and the parameter types, arithmetic on them is folded,
+;; the branches of conditionals on them are selected, and the
+;; (unroll (k start end) body ...) loops are expanded.
+;;
+;; The statements are begin, let (which binds sequentially, like let*),
+;; set!, if, when, unless, for, while, unroll, barrier and return.
+;; (local-array type size) and (private-array type size) can appear
+;; as the initial values of let bindings. Expressions include arithmetic,
+;; comparisons, and/or/not, bitwise operations, (ref pointer index),
+;; (vector type element ...), (cast type value), (convert type value),
+;; (swizzle vector xyzw) and calls to OpenCL built-in functions,
+;; whose names are written with dashes instead of underscores.
+
+(use-modules (ice-9 match)
+	     (ice-9 receive)
+	     (srfi srfi-1)
+	     (srfi srfi-9))
+
+(define scalar-types
+  ;; in the order of promotion
+  '(char uchar short ushort int uint long ulong half float double))
+
+(define integer-types '(char uchar short ushort int uint long ulong))
+
+(define address-spaces '(global constant local private))
+
+(define (split-vector-type type)
+  ;; returns the scalar base and the width of a numeric type,
+  ;; or #f and #f for other types
+  (if (symbol? type)
+      (let* ((name (symbol->string type))
+	     (length (string-length name))
+	     (digits (let loop ((i length))
+		       (if (and (> i 0)
+				(char-numeric? (string-ref name (- i 1))))
+			   (loop (- i 1))
+			   i)))
+	     (base (string->symbol (substring name 0 digits)))
+	     (width (if (= digits length)
+			1
+			(string->number (substring name digits)))))
+	(if (and (memq base scalar-types)
+		 (memv width '(1 2 3 4 8 16)))
+	    (values base width)
+	    (values #f #f)))
+      (values #f #f)))
+
+(define (vector-type base width)
+  (if (= width 1)
+      base
+      (symbol-append base (string->symbol (number->string width)))))
+
+(define (type-size type)
+  (receive (base width) (split-vector-type type)
+    (* (match base
+	 ((or 'char 'uchar) 1)
+	 ((or 'short 'ushort 'half) 2)
+	 ((or 'int 'uint 'float) 4)
+	 ((or 'long 'ulong 'double) 8))
+       (if (= width 3) 4 width))))
+
+;; Types are symbols naming the scalar and vector types,
+;; (pointer address-space element-type) lists, type variables
+;; for the types that are yet to be inferred, and the "weak" types
+;; of numeric literals, which adapt to the types they are used with.
+
+(define-record-type <type-variable>
+  (make-type-variable binding hint)
+  type-variable?
+  (binding type-variable-binding set-type-variable-binding!)
+  (hint type-variable-hint set-type-variable-hint!))
+
+(define (fresh-type)
+  (make-type-variable #f #f))
+
+(define (pointer-type space element)
+  `(pointer ,space ,element))
+
+(define (pointer-type? type)
+  (and (pair? type) (eq? (car type) 'pointer)))
+
+(define pointer-space cadr)
+
+(define pointer-element caddr)
+
+(define (weak-type? type)
+  (memq type '(integer-literal real-literal)))
+
+(define (resolve type)
+  (if (and (type-variable? type) (type-variable-binding type))
+      (resolve (type-variable-binding type))
+      type))
+
+(define (constrain! a b)
+  ;; make the unknown one of the types a and b equal to the other
+  (let ((a (resolve a))
+	(b (resolve b)))
+    (cond ((eq? a b))
+	  ((type-variable? a)
+	   (bind-type! a b))
+	  ((type-variable? b)
+	   (bind-type! b a))
+	  ((and (pointer-type? a) (pointer-type? b))
+	   (constrain! (pointer-element a) (pointer-element b))))))
+
+(define (bind-type! variable type)
+  (cond ((weak-type? type)
+	 (unless (type-variable-hint variable)
+	   (set-type-variable-hint! variable type)))
+	(else
+	 (when (and (type-variable? type)
+		    (not (type-variable-hint type)))
+	   (set-type-variable-hint! type (type-variable-hint variable)))
+	 (set-type-variable-binding! variable type))))
+
+(define (integer-type? type)
+  (receive (base width) (split-vector-type type)
+    (and base (memq base integer-types))))
+
+(define (promote a b)
+  ;; the type of an arithmetic operation on values of types a and b
+  (let ((a (resolve a))
+	(b (resolve b)))
+    (cond ((type-variable? a) a)
+	  ((type-variable? b) b)
+	  ((and (weak-type? a) (weak-type? b))
+	   (if (or (eq? a 'real-literal) (eq? b 'real-literal))
+	       'real-literal
+	       'integer-literal))
+	  ((weak-type? a) (promote-weak a b))
+	  ((weak-type? b) (promote-weak b a))
+	  (else (promote-strong a b)))))
+
+(define (promote-weak weak strong)
+  (if (and (eq? weak 'real-literal) (integer-type? strong))
+      'float
+      strong))
+
+(define (promote-strong a b)
+  (receive (base-a width-a) (split-vector-type a)
+    (receive (base-b width-b) (split-vector-type b)
+      (cond ((not base-a) a) ; pointer arithmetic
+	    ((not base-b) b)
+	    ((> width-a 1) a)
+	    ((> width-b 1) b)
+	    (else
+	     (let ((type (if (>= (list-index (lambda (t) (eq? t base-a))
+					     scalar-types)
+				 (list-index (lambda (t) (eq? t base-b))
+					     scalar-types))
+			     base-a
+			     base-b)))
+	       (if (memq type '(char uchar short ushort))
+		   'int
+		   type)))))))
+
+(define (concrete-type type)
+  ;; the type that is emitted for the possibly unknown type
+  (let ((type (resolve type)))
+    (cond ((type-variable? type)
+	   (if (eq? (type-variable-hint type) 'real-literal)
+	       'float
+	       'int))
+	  ((eq? type 'integer-literal) 'int)
+	  ((eq? type 'real-literal) 'float)
+	  ((pointer-type? type)
+	   (pointer-type (pointer-space type)
+			 (concrete-type (pointer-element type))))
+	  (else type))))
+
+(define (type->c type)
+  (let ((type (concrete-type type)))
+    (if (pointer-type? type)
+	(string-append (address-space->c (pointer-space type)) " "
+		       (type->c (pointer-element type)) " *")
+	(symbol->string type))))
+
+(define (address-space->c space)
+  (string-append "__" (symbol->string space)))
+
+(define (identifier->c symbol)
+  (list->string
+   (map (lambda (c)
+	  (if (or (char-alphabetic? c) (char-numeric? c))
+	      c
+	      #\_))
+	(string->list (symbol->string symbol)))))
+
+;; The generated code is a tree of strings, type slots and real
+;; literals, which is flattened once the whole kernel has been compiled,
+;; so that the declarations get the types that were inferred after them,
+;; and the literals the precision of the values they are used with.
+
+(define-record-type <type-slot>
+  (type-slot type)
+  type-slot?
+  (type type-slot-type))
+
+(define-record-type <real-literal>
+  (make-real-literal number context)
+  real-literal?
+  (number real-literal-number)
+  (context real-literal-context set-real-literal-context!))
+
+(define (number->c number)
+  (if (and (exact? number) (integer? number))
+      (number->string number)
+      (make-real-literal (exact->inexact number) #f)))
+
+(define (use-literal! code type)
+  ;; makes the literal code, if it is one, take the precision of type
+  (when (and (real-literal? code) (not (real-literal-context code)))
+    (set-real-literal-context! code type)))
+
+(define (real-literal->c literal)
+  ;; unsuffixed literals are doubles, so only floats get the suffix
+  (let ((digits (number->string (real-literal-number literal)))
+	(context (real-literal-context literal)))
+    (receive (base _) (split-vector-type (and context (concrete-type context)))
+      (if (eq? base 'double)
+	  digits
+	  (string-append digits "f")))))
+
+(define (render code)
+  (cond ((string? code) code)
+	((type-slot? code) (type->c (type-slot-type code)))
+	((real-literal? code) (real-literal->c code))
+	((list? code) (string-concatenate (map render code)))
+	(else (error "define-cl-kernel: invalid code" code))))
+
+(define (interleave items separator)
+  (match items
+    (() '())
+    ((first . rest)
+     (cons first (append-map (lambda (item) (list separator item)) rest)))))
+
+;; Specialization on compile-time constants
+
+(define (fold-constant operator arguments)
+  ;; the value of the operation on numbers, or #f
+  (define (truth x) (if x 1 0))
+  (and (every number? arguments)
+       (match (cons operator arguments)
+	 (('+ . xs) (apply + xs))
+	 (('- . xs) (apply - xs))
+	 (('* . xs) (apply * xs))
+	 (('/ a b) (if (and (exact? a) (exact? b) (integer? a) (integer? b))
+		       (and (not (zero? b)) (quotient a b))
+		       (/ a b)))
+	 (((or 'modulo 'remainder) a b)
+	  (and (exact? a) (exact? b) (not (zero? b)) (remainder a b)))
+	 (('min . xs) (apply min xs))
+	 (('max . xs) (apply max xs))
+	 (('= a b) (truth (= a b)))
+	 (('!= a b) (truth (not (= a b))))
+	 (('< a b) (truth (< a b)))
+	 (('> a b) (truth (> a b)))
+	 (('<= a b) (truth (<= a b)))
+	 (('>= a b) (truth (>= a b)))
+	 (('not a) (truth (zero? a)))
+	 (('and . xs) (truth (every (lambda (x) (not (zero? x))) xs)))
+	 (('or . xs) (truth (any (lambda (x) (not (zero? x))) xs)))
+	 (_ #f))))
+
+(define (specialize form constants)
+  (define (shadow names)
+    (remove (lambda (constant) (memq (car constant) names)) constants))
+  (define (specialize-body body constants)
+    (map (lambda (form) (specialize form constants)) body))
+  (define (true? condition)
+    (not (zero? condition)))
+  (match form
+    ((? symbol? name)
+     (match (assq name constants)
+       ((_ . value) value)
+       (#f name)))
+    (((or 'let 'let*) bindings . body)
+     (let loop ((bindings bindings)
+		(specialized '())
+		(constants constants))
+       (match bindings
+	 (()
+	  `(let ,(reverse specialized) ,@(specialize-body body constants)))
+	 (((name value) . rest)
+	  (loop rest
+		`((,name ,(specialize value constants)) . ,specialized)
+		(remove (lambda (constant) (eq? (car constant) name))
+			constants))))))
+    (('for (variable start end . step) . body)
+     `(for (,variable ,(specialize start constants)
+		      ,(specialize end constants)
+		      ,@(specialize-body step constants))
+	   ,@(specialize-body body (shadow (list variable)))))
+    (('unroll (variable start end . step) . body)
+     (let ((start (specialize start constants))
+	   (end (specialize end constants))
+	   (step (match step
+		   (() 1)
+		   ((step) (specialize step constants)))))
+       (unless (and (integer? start) (integer? end) (integer? step)
+		    (positive? step))
+	 (error "define-cl-kernel: unroll needs constant bounds" form))
+       `(begin
+	  ,@(append-map
+	     (lambda (k)
+	       (specialize-body body (cons (cons variable k)
+					   (shadow (list variable)))))
+	     (iota (max 0 (quotient (+ (- end start) step -1) step))
+		   start step)))))
+    (('if condition then . otherwise)
+     (let ((condition (specialize condition constants)))
+       (if (number? condition)
+	   (cond ((true? condition) (specialize then constants))
+		 ((pair? otherwise) (specialize (car otherwise) constants))
+		 (else '(begin)))
+	   `(if ,condition ,(specialize then constants)
+		,@(specialize-body otherwise constants)))))
+    (((and keyword (or 'when 'unless)) condition . body)
+     (let ((condition (specialize condition constants)))
+       (if (number? condition)
+	   (if (eq? (true? condition) (eq? keyword 'when))
+	       `(begin ,@(specialize-body body constants))
+	       '(begin))
+	   `(,keyword ,condition ,@(specialize-body body constants)))))
+    ((operator . arguments)
+     (let ((arguments (specialize-body arguments constants)))
+       (or (fold-constant operator arguments)
+	   `(,operator ,@arguments))))
+    (_ form)))
+
+;; Type inference and code generation
+
+(define binary-operators
+  '((+ . "+") (- . "-") (* . "*") (/ . "/")
+    (modulo . "%") (remainder . "%")
+    (bitwise-and . "&") (bitwise-or . "|") (bitwise-xor . "^")
+    (shift-left . "<<") (<< . "<<") (shift-right . ">>") (>> . ">>")))
+
+(define comparison-operators
+  '((= . "==") (!= . "!=") (< . "<") (> . ">") (<= . "<=") (>= . ">=")))
+
+(define work-item-functions
+  '(get-global-id get-local-id get-group-id get-global-size
+		  get-local-size get-num-groups get-global-offset
+		  get-work-dim))
+
+(define scalar-result-functions
+  '(dot length distance fast-length fast-distance any all))
+
+(define mixed-argument-functions
+  ;; the built-in functions whose arguments don't all share one type:
+  ;; the number of the leading arguments that do, and the types
+  ;; of the arguments that follow them, as far as they are fixed
+  '((pown 1 int) (rootn 1 int) (ldexp 1 int)
+    (frexp 1) (lgamma-r 1) (modf 1) (fract 1) (sincos 1)
+    (remquo 2) (select 2) (shuffle 1) (shuffle2 2)))
+
+(define (vload/vstore-width name prefix)
+  ;; the width of vloadN and vstoreN, or #f for other functions
+  (let ((name (symbol->string name)))
+    (and (string-prefix? prefix name)
+	 (string->number (substring name (string-length prefix))))))
+
+(define (parse-parameter parameter)
+  ;; returns the name and the type of a kernel parameter
+  (match parameter
+    ((? symbol? name)
+     (values name (fresh-type)))
+    ((name ((? (lambda (s) (memq s address-spaces)) space)))
+     (values name (pointer-type space (fresh-type))))
+    ((name ((? (lambda (s) (memq s address-spaces)) space) element))
+     (values name (pointer-type space element)))
+    ((name type)
+     (values name type))
+    (_
+     (error "define-cl-kernel: invalid parameter" parameter))))
+
+(define (argument-type type)
+  ;; how the argument of the given type is bound to the kernel
+  (let ((type (concrete-type type)))
+    (cond ((pointer-type? type)
+	   (if (eq? (pointer-space type) 'local)
+	       (cons 'local (pointer-element type))
+	       'buffer))
+	  ((receive (base _) (split-vector-type type) (eq? base 'half))
+	   ;; cl-bind-arguments has no way to pack them
+	   (error "define-cl-kernel: half arguments must be passed in buffers"
+		  type))
+	  (else type))))
+
+(define-record-type <cl-kernel-spec>
+  (make-cl-kernel-spec name source argument-types)
+  cl-kernel-spec?
+  (name cl-kernel-spec-name)
+  (source cl-kernel-spec-source)
+  (argument-types cl-kernel-spec-argument-types))
+
+(define (compile-cl-kernel name parameters body constants)
+  (define hoisted '())
+  (define names '())
+
+  (define (fresh-name symbol)
+    (let loop ((candidate (identifier->c symbol))
+	       (n 1))
+      (if (member candidate names)
+	  (loop (string-append (identifier->c symbol) "_"
+			       (number->string n))
+		(+ n 1))
+	  (begin
+	    (set! names (cons candidate names))
+	    candidate))))
+
+  (define (lookup symbol env)
+    (match (assq symbol env)
+      ((_ c-name type) (values c-name type))
+      (#f (error "define-cl-kernel: unbound variable" symbol))))
+
+  (define (element-type! type form)
+    (let ((type (resolve type)))
+      (cond ((pointer-type? type)
+	     (pointer-element type))
+	    ((type-variable? type)
+	     (let ((element (fresh-type)))
+	       (constrain! type (pointer-type 'global element))
+	       element))
+	    (else
+	     (error "define-cl-kernel: not a pointer" form)))))
+
+  (define (arguments forms env)
+    ;; returns the codes and the types of the expressions
+    (let loop ((forms forms) (codes '()) (types '()))
+      (match forms
+	(()
+	 (values (reverse codes) (reverse types)))
+	((form . rest)
+	 (receive (code type) (expression form env)
+	   (loop rest (cons code codes) (cons type types)))))))
+
+  (define (call function forms env)
+    (receive (codes types) (arguments forms env)
+      (values
+       `(,(identifier->c function) "(" ,@(interleave codes ", ") ")")
+       (cond ((memq function work-item-functions)
+	      'int)
+	     ((vload/vstore-width function "vload")
+	      => (lambda (width)
+		   (receive (base _)
+		       (split-vector-type
+			(concrete-type (element-type! (cadr types) forms)))
+		     (vector-type base width))))
+	     ((vload/vstore-width function "vstore")
+	      'void)
+	     ((null? types)
+	      'int)
+	     (else
+	      (match (or (assq-ref mixed-argument-functions function)
+			 (list (length types)))
+		((shared . fixed)
+		 (let* ((shared (min shared (length types)))
+			(shared-types (take types shared))
+			(type (or (find (lambda (type)
+					  (not (weak-type? (resolve type))))
+					shared-types)
+				  (car types))))
+		   (for-each (lambda (other) (constrain! type other))
+			     shared-types)
+		   (for-each (lambda (code) (use-literal! code type))
+			     (take codes shared))
+		   (let loop ((types (drop types shared))
+			      (fixed fixed))
+		     (when (and (pair? types) (pair? fixed))
+		       (constrain! (car types) (car fixed))
+		       (loop (cdr types) (cdr fixed)))))))
+	      (if (memq function scalar-result-functions)
+		  (let ((type (resolve (car types))))
+		    (receive (base width) (split-vector-type type)
+		      (or base type)))
+		  (car types)))))))
+
+  (define (expression form env)
+    ;; returns the code and the type of the expression
+    (match form
+      ((? number? n)
+       (values (number->c n)
+	       (if (and (exact? n) (integer? n))
+		   'integer-literal
+		   'real-literal)))
+      ((? symbol? symbol)
+       (lookup symbol env))
+      (('ref pointer index)
+       (receive (pointer-code pointer-type) (expression pointer env)
+	 (receive (index-code index-type) (expression index env)
+	   (values `(,pointer-code "[" ,index-code "]")
+		   (element-type! pointer-type form)))))
+      (('vector type . elements)
+       (receive (codes _) (arguments elements env)
+	 (for-each (lambda (code) (use-literal! code type)) codes)
+	 (values `("((" ,(symbol->string type) ")("
+		   ,@(interleave codes ", ") "))")
+		 type)))
+      (('cast type value)
+       (receive (code _) (expression value env)
+	 (use-literal! code type)
+	 (values `("((" ,(symbol->string type) ") " ,code ")") type)))
+      (('convert type value)
+       (receive (code _) (expression value env)
+	 (use-literal! code type)
+	 (values `("convert_" ,(symbol->string type) "(" ,code ")") type)))
+      (('swizzle vector components)
+       (receive (code type) (expression vector env)
+	 (receive (base width) (split-vector-type (concrete-type type))
+	   (let ((n (string-length (symbol->string components))))
+	     (values `(,code "." ,(symbol->string components))
+		     (vector-type base n))))))
+      (('if condition then otherwise)
+       (receive (condition-code _) (expression condition env)
+	 (receive (then-code then-type) (expression then env)
+	   (receive (else-code else-type) (expression otherwise env)
+	     (constrain! then-type else-type)
+	     (use-literal! then-code else-type)
+	     (use-literal! else-code then-type)
+	     (values `("(" ,condition-code " ? " ,then-code " : "
+		       ,else-code ")")
+		     (promote then-type else-type))))))
+      (('- value)
+       (receive (code type) (expression value env)
+	 (values `("(-" ,code ")") type)))
+      (('bitwise-not value)
+       (receive (code type) (expression value env)
+	 (values `("(~" ,code ")") type)))
+      (('not value)
+       (receive (code _) (expression value env)
+	 (values `("(!" ,code ")") 'int)))
+      (((and operator (or 'and 'or)) . forms)
+       (receive (codes _) (arguments forms env)
+	 (values `("(" ,@(interleave codes (if (eq? operator 'and)
+					       " && "
+					       " || "))
+		   ")")
+		 'int)))
+      (((? (lambda (op) (assq op comparison-operators)) operator) a b)
+       (receive (a-code a-type) (expression a env)
+	 (receive (b-code b-type) (expression b env)
+	   (constrain! a-type b-type)
+	   (use-literal! a-code b-type)
+	   (use-literal! b-code a-type)
+	   (values `("(" ,a-code " "
+		     ,(assq-ref comparison-operators operator)
+		     " " ,b-code ")")
+		   'int))))
+      (((? (lambda (op) (assq op binary-operators)) operator)
+	first . rest)
+       (receive (first-code first-type) (expression first env)
+	 (let fold ((code first-code)
+		    (type first-type)
+		    (rest rest))
+	   (match rest
+	     (()
+	      (values code type))
+	     ((argument . rest)
+	      (receive (argument-code argument-type) (expression argument env)
+		(constrain! type argument-type)
+		(use-literal! code argument-type)
+		(use-literal! argument-code type)
+		(fold `("(" ,code " " ,(assq-ref binary-operators operator)
+			" " ,argument-code ")")
+		      (promote type argument-type)
+		      rest)))))))
+      (((? symbol? function) . forms)
+       (call function forms env))
+      (_
+       (error "define-cl-kernel: invalid expression" form))))
+
+  (define (indentation level)
+    (make-string (* 2 level) #\space))
+
+  (define (block forms env level)
+    (append-map (lambda (form) (statement form env level)) forms))
+
+  (define (binding name value env level)
+    ;; returns the declaration code and the extended environment
+    (match value
+      (('local-array type size)
+       (unless (integer? size)
+	 (error "define-cl-kernel: the size of a local array must be constant"
+		value))
+       (let ((c-name (fresh-name name)))
+	 (set! hoisted
+	       (cons `(,(indentation 1) "__local " ,(symbol->string type)
+		       " " ,c-name "[" ,(number->string size) "];\n")
+		     hoisted))
+	 (values '() `((,name ,c-name ,(pointer-type 'local type)) . ,env))))
+      (('private-array type size)
+       (let ((c-name (fresh-name name)))
+	 (receive (size-code _) (expression size env)
+	   (values `(,(indentation level) ,(symbol->string type) " "
+		     ,c-name "[" ,size-code "];\n")
+		   `((,name ,c-name ,(pointer-type 'private type))
+		     . ,env)))))
+      (_
+       (receive (code type) (expression value env)
+	 (let ((c-name (fresh-name name))
+	       (variable (fresh-type)))
+	   (constrain! variable type)
+	   (use-literal! code variable)
+	   (values `(,(indentation level) ,(type-slot variable) " "
+		     ,c-name " = " ,code ";\n")
+		   `((,name ,c-name ,variable) . ,env)))))))
+
+  (define (statement form env level)
+    (let ((indent (indentation level)))
+      (match form
+	(('begin . forms)
+	 (block forms env level))
+	(((or 'let 'let*) bindings . body)
+	 (let loop ((bindings bindings)
+		    (declarations '())
+		    (env env))
+	   (match bindings
+	     (()
+	      `(,indent "{\n"
+		,@(reverse declarations)
+		,@(block body env (+ level 1))
+		,indent "}\n"))
+	     (((name value) . rest)
+	      (receive (declaration env) (binding name value env (+ level 1))
+		(loop rest (cons declaration declarations) env))))))
+	(('set! target value)
+	 (receive (target-code target-type) (expression target env)
+	   (receive (value-code value-type) (expression value env)
+	     (constrain! target-type value-type)
+	     (use-literal! value-code target-type)
+	     `(,indent ,target-code " = " ,value-code ";\n"))))
+	(('if condition then . otherwise)
+	 (receive (code _) (expression condition env)
+	   `(,indent "if(" ,code ") {\n"
+	     ,@(statement then env (+ level 1))
+	     ,@(match otherwise
+		 (() `(,indent "}\n"))
+		 ((otherwise)
+		  `(,indent "}\n" ,indent "else {\n"
+		    ,@(statement otherwise env (+ level 1))
+		    ,indent "}\n"))))))
+	(('when condition . body)
+	 (statement `(if ,condition (begin ,@body)) env level))
+	(('unless condition . body)
+	 (statement `(if (not ,condition) (begin ,@body)) env level))
+	(('for (variable start end . step) . body)
+	 (receive (start-code start-type) (expression start env)
+	   (receive (end-code end-type) (expression end env)
+	     (let ((c-name (fresh-name variable))
+		   (type (fresh-type)))
+	       (constrain! type start-type)
+	       (constrain! type end-type)
+	       (use-literal! start-code type)
+	       (use-literal! end-code type)
+	       (let ((env `((,variable ,c-name ,type) . ,env)))
+		 (receive (step-code _) (match step
+					  (() (values "1" 'integer-literal))
+					  ((step) (expression step env)))
+		   `(,indent "for(" ,(type-slot type) " " ,c-name " = "
+		     ,start-code "; " ,c-name " < " ,end-code "; "
+		     ,c-name " += " ,step-code ") {\n"
+		     ,@(block body env (+ level 1))
+		     ,indent "}\n")))))))
+	(('while condition . body)
+	 (receive (code _) (expression condition env)
+	   `(,indent "while(" ,code ") {\n"
+	     ,@(block body env (+ level 1))
+	     ,indent "}\n")))
+	(('barrier . fences)
+	 `(,indent "barrier("
+	   ,@(interleave
+	      (map (match-lambda
+		     ('local "CLK_LOCAL_MEM_FENCE")
+		     ('global "CLK_GLOBAL_MEM_FENCE")
+		     (fence (error "define-cl-kernel: invalid fence" fence)))
+		   (if (null? fences) '(local) fences))
+	      " | ")
+	   ");\n"))
+	(('return)
+	 `(,indent "return;\n"))
+	(_
+	 (receive (code _) (expression form env)
+	   `(,indent ,code ";\n"))))))
+
+  (let loop ((parameters parameters)
+	     (declarations '())
+	     (types '())
+	     (env '()))
+    (match parameters
+      ((parameter . rest)
+       (receive (symbol type) (parse-parameter
+			       (specialize parameter constants))
+	 (let ((c-name (fresh-name symbol)))
+	   (loop rest
+		 (cons `(,(type-slot type) " " ,c-name) declarations)
+		 (cons type types)
+		 `((,symbol ,c-name ,type) . ,env)))))
+      (()
+       (let* ((body (statement (specialize `(begin ,@body) constants)
+			       env 1))
+	      (source (render `("__kernel void " ,(identifier->c name) "("
+				,@(interleave (reverse declarations) ", ")
+				") {\n"
+				,@(reverse hoisted)
+				,@body
+				"}\n"))))
+	 (make-cl-kernel-spec (identifier->c name) source
+			      (map argument-type (reverse types))))))))
+
+(define-syntax define-cl-kernel
+  (syntax-rules ()
+    ((_ ((name constant ...) parameter ...) body ...)
+     (define (name constant ...)
+       (compile-cl-kernel 'name '(parameter ...) '(body ...)
+			  (list (cons 'constant constant) ...))))
+    ((_ (name parameter ...) body ...)
+     (define name
+       (compile-cl-kernel 'name '(parameter ...) '(body ...) '())))))
+
+(define (cl-make-kernel spec . devices)
+  (let ((program (apply cl-make-program (cl-kernel-spec-source spec)
+			devices)))
+    (and program
+	 (cl-kernel program (cl-kernel-spec-name spec)))))
+
+(define (cl-bind-kernel-arguments spec kernel . arguments)
+  ;; buffers are passed as they are, scalars and vectors are tagged
+  ;; with their types, and local memory is given as a number of elements
+  (apply cl-bind-arguments kernel
+	 (map (lambda (type argument)
+		(match type
+		  ('buffer argument)
+		  (('local . element)
+		   (cons 'local (* argument (type-size element))))
+		  (_ (cons type argument))))
+	      (cl-kernel-spec-argument-types spec)
+	      arguments)))
@@ -0,0 +1,927 @@
+// Re-executes a trace captured by clops (see clops-trace.h) against
+// a local OpenCL implementation, and compares the time of every kind
+// of call with the time that was recorded.
+//
+// usage: clops-replay [-p platform-index] [-t gpu|cpu|accelerator|all]
+//                     [-v] trace-file
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <time.h>
+
+#define CL_TARGET_OPENCL_VERSION 120
+#include <CL/opencl.h>
+
+#include "clops-trace.h"
+
+#define WARN(msg, ...) fprintf(stderr, msg "\n", ## __VA_ARGS__)
+
+static inline uint64_t
+now_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return ((uint64_t) t.tv_sec) * 1000000000ULL + (uint64_t) t.tv_nsec;
+}
+
+// Objects are looked up by their ids from the trace in open addressing
+// hash tables. Released objects leave their ids with NULL values.
+
+struct object_map {
+  uint64_t *ids;
+  void **objects;
+  size_t capacity;
+  size_t count;
+};
+
+static size_t
+object_slot(const struct object_map *map, uint64_t id) {
+  size_t mask = map->capacity - 1;
+  size_t slot = (id * 0x9E3779B97F4A7C15ULL) >> 17 & mask;
+  while(map->ids[slot] != id && map->ids[slot] != 0) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+static void *
+find_object(const struct object_map *map, uint64_t id) {
+  if(map->capacity == 0 || id == 0) {
+    return NULL;
+  }
+  return map->objects[object_slot(map, id)];
+}
+
+static void
+set_object(struct object_map *map, uint64_t id, void *object) {
+  if(id == 0) {
+    return;
+  }
+  if(2 * (map->count + 1) > map->capacity) {
+    struct object_map larger = {
+      .capacity = map->capacity ? 2 * map->capacity : 64,
+    };
+    larger.ids = calloc(larger.capacity, sizeof(uint64_t));
+    larger.objects = calloc(larger.capacity, sizeof(void *));
+    for(size_t i = 0; i < map->capacity; ++i) {
+      if(map->ids[i] != 0) {
+	size_t slot = object_slot(&larger, map->ids[i]);
+	larger.ids[slot] = map->ids[i];
+	larger.objects[slot] = map->objects[i];
+	++larger.count;
+      }
+    }
+    free(map->ids);
+    free(map->objects);
+    *map = larger;
+  }
+  size_t slot = object_slot(map, id);
+  if(map->ids[slot] == 0) {
+    map->ids[slot] = id;
+    ++map->count;
+  }
+  map->objects[slot] = object;
+}
+
+struct replay_buffer {
+  cl_mem mem;
+  void *host; // for the buffers that use host memory, until released
+};
+
+// the host memory of a buffer is freed once the runtime is done with
+// it, so that releasing the buffer doesn't have to wait for its commands
+static void CL_CALLBACK
+free_host_memory(cl_mem mem, void *host) {
+  free(host);
+}
+
+// kernels of the same name are reported together
+struct kernel_stats {
+  char *name;
+  uint64_t launches;
+  uint64_t device_ns;
+  struct kernel_stats *next;
+};
+
+struct replay_kernel {
+  cl_kernel kernel;
+  struct kernel_stats *stats;
+};
+
+struct replay_launch {
+  struct kernel_stats *kernel;
+  cl_event event;
+  struct replay_launch *next;
+};
+
+struct replay_queue {
+  cl_command_queue queue;
+  struct replay_launch *launches; // not yet accounted for
+  struct replay_queue *next;
+};
+
+struct replay_slot {
+  cl_mem buffer;
+  void *host;
+  cl_event event; // the last transfer that used the slot, or NULL
+};
+
+// the staging pools that transfers were captured through, recreated
+// with the same geometry for every queue that they were used on
+struct replay_pool {
+  cl_command_queue queue;
+  size_t chunk_size;
+  uint32_t num_slots;
+  uint32_t next_slot;
+  struct replay_pool *next;
+  struct replay_slot slots[];
+};
+
+struct record_stats {
+  uint64_t count;
+  uint64_t recorded_ns;
+  uint64_t replayed_ns;
+};
+
+static struct object_map contexts, devices, queues, programs, kernels, buffers;
+static struct kernel_stats *kernel_stats = NULL;
+static struct replay_queue *all_queues = NULL;
+static struct replay_pool *all_pools = NULL;
+static struct record_stats record_stats[NUM_TRACE_RECORD_TYPES];
+
+static cl_platform_id platform;
+static cl_device_id *local_devices;
+static cl_uint num_local_devices;
+
+static char *zeros;   // the source of writes whose contents weren't captured
+static char *sink;    // the target of all reads
+static int verbose = 0;
+
+static void
+account_launches(struct replay_queue *queue) {
+  for(struct replay_launch *launch = queue->launches; launch; ) {
+    cl_ulong start, end;
+    if(clGetEventProfilingInfo(launch->event, CL_PROFILING_COMMAND_START,
+			       sizeof(start), &start, NULL) == CL_SUCCESS
+       && clGetEventProfilingInfo(launch->event, CL_PROFILING_COMMAND_END,
+				  sizeof(end), &end, NULL) == CL_SUCCESS) {
+      launch->kernel->device_ns += end - start;
+    }
+    clReleaseEvent(launch->event);
+    struct replay_launch *next = launch->next;
+    free(launch);
+    launch = next;
+  }
+  queue->launches = NULL;
+}
+
+static cl_int
+replay_context(struct trace_reader *in) {
+  uint64_t id = trace_get_u64(in);
+  cl_uint num_devices = trace_get_u32(in);
+  cl_device_id *mapped = calloc(num_devices, sizeof(cl_device_id));
+  cl_uint num_mapped = 0;
+  for(cl_uint i = 0; i < num_devices && !in->error; ++i) {
+    uint64_t device_id = trace_get_u64(in);
+    trace_get_u64(in); // the device type
+    char *name = trace_get_string(in);
+    cl_device_id device = find_object(&devices, device_id);
+    if(device == NULL) {
+      device = local_devices[i % num_local_devices];
+      set_object(&devices, device_id, device);
+      char local_name[256] = "?";
+      clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(local_name),
+		      local_name, NULL);
+      local_name[sizeof(local_name) - 1] = '\0';
+      WARN("device %s replayed on %s", name, local_name);
+    }
+    free(name);
+    int duplicate = 0;
+    for(cl_uint j = 0; j < num_mapped; ++j) {
+      duplicate |= mapped[j] == device;
+    }
+    if(!duplicate) {
+      mapped[num_mapped++] = device;
+    }
+  }
+  cl_context_properties properties[] = {
+    CL_CONTEXT_PLATFORM, (cl_context_properties) platform, 0
+  };
+  cl_int result;
+  cl_context context = clCreateContext(properties, num_mapped, mapped,
+				       NULL, NULL, &result);
+  free(mapped);
+  if(result == CL_SUCCESS) {
+    set_object(&contexts, id, context);
+  }
+  return result;
+}
+
+static cl_int
+replay_queue(struct trace_reader *in) {
+  uint64_t id = trace_get_u64(in);
+  cl_context context = find_object(&contexts, trace_get_u64(in));
+  cl_device_id device = find_object(&devices, trace_get_u64(in));
+  cl_command_queue_properties properties = trace_get_u64(in);
+  if(context == NULL || device == NULL) {
+    return CL_INVALID_CONTEXT;
+  }
+  cl_int result;
+  // profiling is needed to measure the kernels
+  cl_command_queue q
+    = clCreateCommandQueue(context, device,
+			   properties | CL_QUEUE_PROFILING_ENABLE, &result);
+  if(result == CL_SUCCESS) {
+    struct replay_queue *queue = calloc(1, sizeof(struct replay_queue));
+    queue->queue = q;
+    queue->next = all_queues;
+    all_queues = queue;
+    set_object(&queues, id, queue);
+  }
+  return result;
+}
+
+static cl_int
+replay_program(struct trace_reader *in) {
+  uint64_t id = trace_get_u64(in);
+  cl_context context = find_object(&contexts, trace_get_u64(in));
+  cl_uint num_devices = trace_get_u32(in);
+  cl_device_id *device_ids = calloc(num_devices + 1, sizeof(cl_device_id));
+  for(cl_uint i = 0; i < num_devices; ++i) {
+    device_ids[i] = find_object(&devices, trace_get_u64(in));
+  }
+  char *source = trace_get_string(in);
+  char *options = trace_get_string(in);
+  cl_int recorded_result = (cl_int) trace_get_u32(in);
+  cl_int result = CL_INVALID_CONTEXT;
+  if(context != NULL) {
+    const char *sources[] = { source };
+    cl_program program
+      = clCreateProgramWithSource(context, 1, sources, NULL, &result);
+    if(result == CL_SUCCESS) {
+      set_object(&programs, id, program);
+      result = clBuildProgram(program, num_devices,
+			      num_devices ? device_ids : NULL,
+			      options, NULL, NULL);
+      if(result != recorded_result) {
+	WARN("program built with result 0x%x, recorded 0x%x",
+	     result, recorded_result);
+      }
+      result = CL_SUCCESS;
+    }
+  }
+  free(options);
+  free(source);
+  free(device_ids);
+  return result;
+}
+
+static cl_int
+replay_kernel(struct trace_reader *in) {
+  uint64_t id = trace_get_u64(in);
+  cl_program program = find_object(&programs, trace_get_u64(in));
+  char *name = trace_get_string(in);
+  if(program == NULL) {
+    free(name);
+    return CL_INVALID_PROGRAM;
+  }
+  cl_int result;
+  cl_kernel k = clCreateKernel(program, name, &result);
+  if(result != CL_SUCCESS) {
+    free(name);
+    return result;
+  }
+  struct replay_kernel *kernel = calloc(1, sizeof(struct replay_kernel));
+  kernel->kernel = k;
+  for(struct kernel_stats *stats = kernel_stats; stats; stats = stats->next) {
+    if(!strcmp(stats->name, name)) {
+      kernel->stats = stats;
+      free(name);
+      break;
+    }
+  }
+  if(kernel->stats == NULL) {
+    kernel->stats = calloc(1, sizeof(struct kernel_stats));
+    kernel->stats->name = name;
+    kernel->stats->next = kernel_stats;
+    kernel_stats = kernel->stats;
+  }
+  set_object(&kernels, id, kernel);
+  return result;
+}
+
+static cl_int
+replay_buffer(struct trace_reader *in) {
+  uint64_t id = trace_get_u64(in);
+  cl_context context = find_object(&contexts, trace_get_u64(in));
+  cl_mem_flags flags = trace_get_u64(in);
+  size_t size = trace_get_u64(in);
+  size_t contents_size;
+  const void *contents = trace_get_blob(in, &contents_size);
+  if(context == NULL) {
+    return CL_INVALID_CONTEXT;
+  }
+  struct replay_buffer *buffer = calloc(1, sizeof(struct replay_buffer));
+  void *host_ptr = NULL;
+  if(flags & (CL_MEM_USE_HOST_PTR | CL_MEM_COPY_HOST_PTR)) {
+    buffer->host = calloc(1, size ? size : 1);
+    if(contents_size == size) {
+      memcpy(buffer->host, contents, size);
+    }
+    host_ptr = buffer->host;
+  }
+  cl_int result;
+  buffer->mem = clCreateBuffer(context, flags, size, host_ptr, &result);
+  if(flags & CL_MEM_COPY_HOST_PTR) {
+    free(buffer->host);
+    buffer->host = NULL;
+  }
+  if(result != CL_SUCCESS) {
+    free(buffer->host);
+    free(buffer);
+    return result;
+  }
+  if(buffer->host
+     && clSetMemObjectDestructorCallback(buffer->mem, free_host_memory,
+					 buffer->host) != CL_SUCCESS) {
+    WARN("The host memory of a buffer will never be freed");
+  }
+  set_object(&buffers, id, buffer);
+  return result;
+}
+
+static cl_int
+replay_release_buffer(struct trace_reader *in) {
+  uint64_t id = trace_get_u64(in);
+  struct replay_buffer *buffer = find_object(&buffers, id);
+  if(buffer == NULL) {
+    return CL_INVALID_MEM_OBJECT;
+  }
+  set_object(&buffers, id, NULL);
+  // the runtime keeps the buffer until its commands complete,
+  // and then frees its host memory
+  cl_int result = clReleaseMemObject(buffer->mem);
+  free(buffer);
+  return result;
+}
+
+static cl_int
+replay_bind(struct trace_reader *in) {
+  struct replay_kernel *kernel = find_object(&kernels, trace_get_u64(in));
+  cl_uint num_arguments = trace_get_u32(in);
+  cl_int result = kernel ? CL_SUCCESS : CL_INVALID_KERNEL;
+  for(cl_uint i = 0; i < num_arguments && !in->error; ++i) {
+    uint8_t kind = trace_get_u8(in);
+    size_t size = trace_get_u64(in);
+    const void *value = NULL;
+    cl_mem mem = NULL;
+    switch(kind) {
+    case TRACE_ARGUMENT_VALUE: {
+      size_t value_size;
+      value = trace_get_blob(in, &value_size);
+      break;
+    }
+    case TRACE_ARGUMENT_MEMORY: {
+      struct replay_buffer *buffer = find_object(&buffers, trace_get_u64(in));
+      mem = buffer ? buffer->mem : NULL;
+      value = &mem;
+      break;
+    }
+    case TRACE_ARGUMENT_LOCAL:
+    default:
+      break;
+    }
+    if(kernel && result == CL_SUCCESS) {
+      result = clSetKernelArg(kernel->kernel, i, size, value);
+    }
+  }
+  return result;
+}
+
+static void
+release_pool(struct replay_pool *pool) {
+  for(uint32_t i = 0; i < pool->num_slots; ++i) {
+    struct replay_slot *slot = &pool->slots[i];
+    if(slot->event) {
+      clWaitForEvents(1, &slot->event);
+      clReleaseEvent(slot->event);
+    }
+    if(slot->host) {
+      clEnqueueUnmapMemObject(pool->queue, slot->buffer, slot->host,
+			      0, NULL, NULL);
+    }
+    if(slot->buffer) {
+      clReleaseMemObject(slot->buffer);
+    }
+  }
+  clFinish(pool->queue);
+  free(pool);
+}
+
+// the pool is made when it's first used, like the slots that clops
+// allocates and maps when the pool is made
+static struct replay_pool *
+find_pool(cl_command_queue queue, size_t chunk_size, uint32_t num_slots,
+	  cl_int *result) {
+  for(struct replay_pool *pool = all_pools; pool; pool = pool->next) {
+    if(pool->queue == queue && pool->chunk_size == chunk_size
+       && pool->num_slots == num_slots) {
+      *result = CL_SUCCESS;
+      return pool;
+    }
+  }
+  cl_context context;
+  *result = clGetCommandQueueInfo(queue, CL_QUEUE_CONTEXT, sizeof(context),
+				  &context, NULL);
+  if(*result != CL_SUCCESS) {
+    return NULL;
+  }
+  struct replay_pool *pool
+    = calloc(1, sizeof(struct replay_pool)
+	     + num_slots * sizeof(struct replay_slot));
+  pool->queue = queue;
+  pool->chunk_size = chunk_size;
+  pool->num_slots = num_slots;
+  for(uint32_t i = 0; i < num_slots; ++i) {
+    struct replay_slot *slot = &pool->slots[i];
+    slot->buffer = clCreateBuffer(context,
+				  CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+				  chunk_size, NULL, result);
+    if(*result != CL_SUCCESS) {
+      slot->buffer = NULL;
+      release_pool(pool);
+      return NULL;
+    }
+    slot->host = clEnqueueMapBuffer(queue, slot->buffer, CL_TRUE,
+				    CL_MAP_READ | CL_MAP_WRITE,
+				    0, chunk_size, 0, NULL, NULL, result);
+    if(*result != CL_SUCCESS) {
+      slot->host = NULL;
+      release_pool(pool);
+      return NULL;
+    }
+  }
+  pool->next = all_pools;
+  all_pools = pool;
+  return pool;
+}
+
+static cl_int
+wait_for_slot(struct replay_slot *slot) {
+  cl_int result = CL_SUCCESS;
+  if(slot->event) {
+    result = clWaitForEvents(1, &slot->event);
+    clReleaseEvent(slot->event);
+    slot->event = NULL;
+  }
+  return result;
+}
+
+// copies the chunks through the slots in turn, as staged_write does
+static cl_int
+staged_write(struct replay_pool *pool, cl_command_queue queue, cl_mem mem,
+	     size_t offset, size_t size, const char *source) {
+  for(size_t position = 0; position < size; ) {
+    struct replay_slot *slot = &pool->slots[pool->next_slot];
+    size_t chunk = size - position < pool->chunk_size
+      ? size - position
+      : pool->chunk_size;
+    pool->next_slot = (pool->next_slot + 1) % pool->num_slots;
+    cl_int result = wait_for_slot(slot);
+    if(result != CL_SUCCESS) {
+      return result;
+    }
+    memcpy(slot->host, source + position, chunk);
+    result = clEnqueueWriteBuffer(queue, mem, CL_FALSE, offset + position,
+				  chunk, slot->host, 0, NULL, &slot->event);
+    if(result != CL_SUCCESS) {
+      slot->event = NULL;
+      return result;
+    }
+    clFlush(queue);
+    position += chunk;
+  }
+  return CL_SUCCESS;
+}
+
+// reads ahead into all the slots and copies the chunks out as they
+// arrive, as staged_read does
+static cl_int
+staged_read(struct replay_pool *pool, cl_command_queue queue, cl_mem mem,
+	    size_t offset, size_t size, char *target) {
+  size_t chunk_size = pool->chunk_size;
+  size_t num_chunks = (size + chunk_size - 1) / chunk_size;
+  uint32_t first_slot = pool->next_slot;
+  cl_int result = CL_SUCCESS;
+
+#define SLOT(k) (&pool->slots[(first_slot + (k)) % pool->num_slots])
+#define CHUNK(k) ((k) + 1 < num_chunks ? chunk_size : size - (k) * chunk_size)
+
+  for(size_t k = 0; k < num_chunks && k < pool->num_slots; ++k) {
+    struct replay_slot *slot = SLOT(k);
+    if((result = wait_for_slot(slot)) != CL_SUCCESS) {
+      return result;
+    }
+    result = clEnqueueReadBuffer(queue, mem, CL_FALSE,
+				 offset + k * chunk_size, CHUNK(k), slot->host,
+				 0, NULL, &slot->event);
+    if(result != CL_SUCCESS) {
+      slot->event = NULL;
+      return result;
+    }
+  }
+  clFlush(queue);
+
+  for(size_t k = 0; k < num_chunks; ++k) {
+    struct replay_slot *slot = SLOT(k);
+    if((result = wait_for_slot(slot)) != CL_SUCCESS) {
+      return result;
+    }
+    memcpy(target + k * chunk_size, slot->host, CHUNK(k));
+    if(k + pool->num_slots < num_chunks) {
+      size_t n = k + pool->num_slots;
+      result = clEnqueueReadBuffer(queue, mem, CL_FALSE,
+				   offset + n * chunk_size, CHUNK(n),
+				   slot->host, 0, NULL, &slot->event);
+      if(result != CL_SUCCESS) {
+	slot->event = NULL;
+	return result;
+      }
+      clFlush(queue);
+    }
+  }
+  pool->next_slot = (first_slot + num_chunks) % pool->num_slots;
+
+#undef CHUNK
+#undef SLOT
+
+  return result;
+}
+
+static cl_int
+replay_write(struct trace_reader *in) {
+  struct replay_queue *queue = find_object(&queues, trace_get_u64(in));
+  struct replay_buffer *buffer = find_object(&buffers, trace_get_u64(in));
+  size_t offset = trace_get_u64(in);
+  size_t size = trace_get_u64(in);
+  size_t chunk_size = trace_get_u64(in);
+  uint32_t num_slots = trace_get_u32(in);
+  size_t contents_size;
+  const void *contents = trace_get_blob(in, &contents_size);
+  if(queue == NULL || buffer == NULL) {
+    return CL_INVALID_VALUE;
+  }
+  // the trace stays in memory, so the contents can be written from it
+  const char *source = contents_size == size ? contents : zeros;
+  if(num_slots > 0 && chunk_size > 0) {
+    cl_int result;
+    struct replay_pool *pool = find_pool(queue->queue, chunk_size, num_slots,
+					 &result);
+    if(pool == NULL) {
+      return result;
+    }
+    return staged_write(pool, queue->queue, buffer->mem, offset, size,
+			source);
+  }
+  return clEnqueueWriteBuffer(queue->queue, buffer->mem, CL_FALSE,
+			      offset, size, source, 0, NULL, NULL);
+}
+
+static cl_int
+replay_read(struct trace_reader *in) {
+  struct replay_queue *queue = find_object(&queues, trace_get_u64(in));
+  struct replay_buffer *buffer = find_object(&buffers, trace_get_u64(in));
+  size_t offset = trace_get_u64(in);
+  size_t size = trace_get_u64(in);
+  size_t chunk_size = trace_get_u64(in);
+  uint32_t num_slots = trace_get_u32(in);
+  if(queue == NULL || buffer == NULL) {
+    return CL_INVALID_VALUE;
+  }
+  if(num_slots > 0 && chunk_size > 0) {
+    cl_int result;
+    struct replay_pool *pool = find_pool(queue->queue, chunk_size, num_slots,
+					 &result);
+    if(pool == NULL) {
+      return result;
+    }
+    return staged_read(pool, queue->queue, buffer->mem, offset, size, sink);
+  }
+  return clEnqueueReadBuffer(queue->queue, buffer->mem, CL_FALSE,
+			     offset, size, sink, 0, NULL, NULL);
+}
+
+static cl_int
+replay_copy(struct trace_reader *in) {
+  struct replay_queue *queue = find_object(&queues, trace_get_u64(in));
+  struct replay_buffer *source = find_object(&buffers, trace_get_u64(in));
+  struct replay_buffer *target = find_object(&buffers, trace_get_u64(in));
+  size_t source_offset = trace_get_u64(in);
+  size_t target_offset = trace_get_u64(in);
+  size_t size = trace_get_u64(in);
+  if(queue == NULL || source == NULL || target == NULL) {
+    return CL_INVALID_VALUE;
+  }
+  return clEnqueueCopyBuffer(queue->queue, source->mem, target->mem,
+			     source_offset, target_offset, size,
+			     0, NULL, NULL);
+}
+
+static cl_int
+replay_launch(struct trace_reader *in) {
+  struct replay_queue *queue = find_object(&queues, trace_get_u64(in));
+  struct replay_kernel *kernel = find_object(&kernels, trace_get_u64(in));
+  cl_uint dims = trace_get_u32(in);
+  size_t global_work_size[3];
+  size_t local_work_size[3];
+  for(int i = 0; i < 3; ++i) {
+    global_work_size[i] = trace_get_u64(in);
+  }
+  int has_local_work_size = trace_get_u8(in);
+  for(int i = 0; i < 3; ++i) {
+    local_work_size[i] = trace_get_u64(in);
+  }
+  if(queue == NULL || kernel == NULL) {
+    return CL_INVALID_VALUE;
+  }
+  struct replay_launch *launch = calloc(1, sizeof(struct replay_launch));
+  cl_int result
+    = clEnqueueNDRangeKernel(queue->queue, kernel->kernel, dims, NULL,
+			     global_work_size,
+			     has_local_work_size ? local_work_size : NULL,
+			     0, NULL, &launch->event);
+  if(result != CL_SUCCESS) {
+    free(launch);
+    return result;
+  }
+  ++kernel->stats->launches;
+  launch->kernel = kernel->stats;
+  launch->next = queue->launches;
+  queue->launches = launch;
+  return result;
+}
+
+static cl_int
+replay_migrate(struct trace_reader *in) {
+  struct replay_queue *queue = find_object(&queues, trace_get_u64(in));
+  cl_mem_migration_flags flags = trace_get_u64(in);
+  cl_uint num_buffers = trace_get_u32(in);
+  cl_mem *mems = calloc(num_buffers + 1, sizeof(cl_mem));
+  cl_uint num_mems = 0;
+  for(cl_uint i = 0; i < num_buffers && !in->error; ++i) {
+    struct replay_buffer *buffer = find_object(&buffers, trace_get_u64(in));
+    if(buffer) {
+      mems[num_mems++] = buffer->mem;
+    }
+  }
+  cl_int result = CL_INVALID_VALUE;
+  if(queue != NULL && num_mems > 0) {
+    result = clEnqueueMigrateMemObjects(queue->queue, num_mems, mems, flags,
+					0, NULL, NULL);
+  }
+  free(mems);
+  return result;
+}
+
+static cl_int
+replay_finish(struct trace_reader *in) {
+  struct replay_queue *queue = find_object(&queues, trace_get_u64(in));
+  if(queue == NULL) {
+    return CL_INVALID_COMMAND_QUEUE;
+  }
+  cl_int result = clFinish(queue->queue);
+  account_launches(queue);
+  return result;
+}
+
+static cl_int
+replay_record(uint32_t type, struct trace_reader *in) {
+  switch(type) {
+  case TRACE_CONTEXT: return replay_context(in);
+  case TRACE_QUEUE: return replay_queue(in);
+  case TRACE_PROGRAM: return replay_program(in);
+  case TRACE_KERNEL: return replay_kernel(in);
+  case TRACE_BUFFER: return replay_buffer(in);
+  case TRACE_RELEASE_BUFFER: return replay_release_buffer(in);
+  case TRACE_BIND: return replay_bind(in);
+  case TRACE_WRITE: return replay_write(in);
+  case TRACE_READ: return replay_read(in);
+  case TRACE_COPY: return replay_copy(in);
+  case TRACE_LAUNCH: return replay_launch(in);
+  case TRACE_MIGRATE: return replay_migrate(in);
+  case TRACE_FINISH: return replay_finish(in);
+  default:
+    WARN("Unknown record type %u", type);
+    return CL_INVALID_VALUE;
+  }
+}
+
+// the size of the largest transfer, for which the zeros
+// and the sink need to be large enough
+static size_t
+largest_transfer(const char *trace, size_t size) {
+  size_t largest = 0;
+  size_t position = sizeof(struct trace_header);
+  while(position + sizeof(struct trace_record_header) <= size) {
+    struct trace_record_header header;
+    memcpy(&header, trace + position, sizeof(header));
+    position += sizeof(header);
+    if(header.size > size - position) {
+      break;
+    }
+    if(header.type == TRACE_WRITE || header.type == TRACE_READ) {
+      struct trace_reader in = { trace + position, header.size, 0, 0 };
+      trace_get_u64(&in);
+      trace_get_u64(&in);
+      trace_get_u64(&in);
+      size_t transfer = trace_get_u64(&in);
+      if(!in.error && transfer > largest) {
+	largest = transfer;
+      }
+    }
+    position += header.size;
+  }
+  return largest;
+}
+
+static char *
+read_file(const char *path, size_t *size) {
+  FILE *file = fopen(path, "rb");
+  if(file == NULL) {
+    return NULL;
+  }
+  size_t capacity = 1 << 20;
+  char *data = malloc(capacity);
+  *size = 0;
+  size_t n;
+  while((n = fread(data + *size, 1, capacity - *size, file)) > 0) {
+    *size += n;
+    if(*size == capacity) {
+      capacity *= 2;
+      data = realloc(data, capacity);
+    }
+  }
+  fclose(file);
+  return data;
+}
+
+static cl_device_type
+parse_device_type(const char *name) {
+  if(!strcasecmp("gpu", name)) {
+    return CL_DEVICE_TYPE_GPU;
+  }
+  if(!strcasecmp("cpu", name)) {
+    return CL_DEVICE_TYPE_CPU;
+  }
+  if(!strcasecmp("accelerator", name)) {
+    return CL_DEVICE_TYPE_ACCELERATOR;
+  }
+  if(strcasecmp("all", name)) {
+    WARN("Unsupported device type: %s", name);
+  }
+  return CL_DEVICE_TYPE_ALL;
+}
+
+static void
+usage(const char *program) {
+  WARN("usage: %s [-p platform-index] [-t gpu|cpu|accelerator|all] [-v]"
+       " trace-file", program);
+}
+
+int
+main(int argc, char *argv[]) {
+  int platform_index = 0;
+  cl_device_type device_type = CL_DEVICE_TYPE_ALL;
+  const char *path = NULL;
+  for(int i = 1; i < argc; ++i) {
+    if(!strcmp("-p", argv[i]) && i + 1 < argc) {
+      platform_index = atoi(argv[++i]);
+    }
+    else if(!strcmp("-t", argv[i]) && i + 1 < argc) {
+      device_type = parse_device_type(argv[++i]);
+    }
+    else if(!strcmp("-v", argv[i])) {
+      verbose = 1;
+    }
+    else if(path == NULL && argv[i][0] != '-') {
+      path = argv[i];
+    }
+    else {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if(path == NULL) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  size_t size;
+  char *trace = read_file(path, &size);
+  struct trace_header header;
+  if(trace == NULL || size < sizeof(header)) {
+    WARN("Failed to read %s", path);
+    return EXIT_FAILURE;
+  }
+  memcpy(&header, trace, sizeof(header));
+  if(memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))
+     || header.version != TRACE_VERSION) {
+    WARN("%s is not a clops trace of version %d", path, TRACE_VERSION);
+    return EXIT_FAILURE;
+  }
+
+  cl_uint num_platforms;
+  if(clGetPlatformIDs(0, NULL, &num_platforms) != CL_SUCCESS
+     || platform_index >= num_platforms) {
+    WARN("OpenCL platform %d is not available", platform_index);
+    return EXIT_FAILURE;
+  }
+  cl_platform_id *platforms = calloc(num_platforms, sizeof(cl_platform_id));
+  clGetPlatformIDs(num_platforms, platforms, NULL);
+  platform = platforms[platform_index];
+  free(platforms);
+  if(clGetDeviceIDs(platform, device_type, 0, NULL, &num_local_devices)
+     != CL_SUCCESS || num_local_devices == 0) {
+    WARN("No devices of the requested type on platform %d", platform_index);
+    return EXIT_FAILURE;
+  }
+  local_devices = calloc(num_local_devices, sizeof(cl_device_id));
+  clGetDeviceIDs(platform, device_type, num_local_devices, local_devices,
+		 NULL);
+
+  size_t largest = largest_transfer(trace, size);
+  zeros = calloc(1, largest + 1);
+  sink = malloc(largest + 1);
+
+  uint64_t recorded_end_ns = 0;
+  uint64_t replay_start_ns = now_ns();
+  uint64_t num_records = 0;
+  size_t position = sizeof(header);
+  while(position + sizeof(struct trace_record_header) <= size) {
+    struct trace_record_header record;
+    memcpy(&record, trace + position, sizeof(record));
+    position += sizeof(record);
+    if(record.size > size - position) {
+      WARN("The trace is truncated");
+      break;
+    }
+    struct trace_reader in = { trace + position, record.size, 0, 0 };
+    uint64_t start = now_ns();
+    cl_int result = replay_record(record.type, &in);
+    uint64_t duration = now_ns() - start;
+    position += record.size;
+    ++num_records;
+
+    if(record.type < NUM_TRACE_RECORD_TYPES) {
+      struct record_stats *stats = &record_stats[record.type];
+      ++stats->count;
+      stats->recorded_ns += record.duration_ns;
+      stats->replayed_ns += duration;
+    }
+    if(record.start_ns + record.duration_ns > recorded_end_ns) {
+      recorded_end_ns = record.start_ns + record.duration_ns;
+    }
+    const char *name = record.type < NUM_TRACE_RECORD_TYPES
+      ? trace_record_names[record.type] : "?";
+    if(in.error) {
+      WARN("Malformed %s record", name);
+    }
+    else if(result != CL_SUCCESS) {
+      WARN("Replaying a %s record failed: 0x%x", name, result);
+    }
+    if(verbose) {
+      printf("%12.6f %-8s %12.6f %12.6f\n", record.start_ns * 1e-9, name,
+	     record.duration_ns * 1e-9, duration * 1e-9);
+    }
+  }
+  for(struct replay_queue *queue = all_queues; queue; queue = queue->next) {
+    clFinish(queue->queue);
+    account_launches(queue);
+  }
+  uint64_t replay_ns = now_ns() - replay_start_ns;
+
+  printf("%llu records, recorded in %.6f s, replayed in %.6f s\n\n",
+	 (unsigned long long) num_records, recorded_end_ns * 1e-9,
+	 replay_ns * 1e-9);
+  printf("%-8s %10s %14s %14s\n", "call", "count", "recorded (s)",
+	 "replayed (s)");
+  for(int type = 1; type < NUM_TRACE_RECORD_TYPES; ++type) {
+    struct record_stats *stats = &record_stats[type];
+    if(stats->count > 0) {
+      printf("%-8s %10llu %14.6f %14.6f\n", trace_record_names[type],
+	     (unsigned long long) stats->count, stats->recorded_ns * 1e-9,
+	     stats->replayed_ns * 1e-9);
+    }
+  }
+  printf("\n%-32s %10s %14s %14s\n", "kernel", "launches", "device (s)",
+	 "mean (us)");
+  for(struct kernel_stats *stats = kernel_stats; stats; stats = stats->next) {
+    printf("%-32s %10llu %14.6f %14.3f\n", stats->name,
+	   (unsigned long long) stats->launches, stats->device_ns * 1e-9,
+	   stats->launches ? stats->device_ns * 1e-3 / stats->launches : 0.0);
+  }
+  return EXIT_SUCCESS;
+}
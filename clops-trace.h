@@ -0,0 +1,190 @@
+#ifndef CLOPS_TRACE_H
+#define CLOPS_TRACE_H
+
+// The format of the trace files written by the capture mode of clops
+// and read by clops-replay. A trace starts with a header, which is
+// followed by records. Every record consists of a fixed-size record
+// header and a payload, made of the fields listed next to the record
+// types below. Integers are stored in the byte order of the host that
+// made the capture, strings and blobs are preceded by their u64 length,
+// and objects are identified by their handles at the time of capture.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_MAGIC "CLOPSTRC"
+#define TRACE_VERSION 3
+
+struct trace_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+};
+
+enum trace_record_type {
+  // context, num_devices, num_devices * (device, device type, name)
+  TRACE_CONTEXT = 1,
+  // queue, context, device, properties
+  TRACE_QUEUE,
+  // program, context, num_devices, num_devices * device,
+  // source, build options, build result (u32)
+  TRACE_PROGRAM,
+  // kernel, program, name
+  TRACE_KERNEL,
+  // buffer, context, flags, size, contents (empty if not sampled)
+  TRACE_BUFFER,
+  // buffer, recorded once nothing holds it any more
+  TRACE_RELEASE_BUFFER,
+  // kernel, num_arguments, num_arguments * (kind (u8), size, value)
+  // where the value is a blob for TRACE_ARGUMENT_VALUE, a buffer
+  // for TRACE_ARGUMENT_MEMORY, and nothing for TRACE_ARGUMENT_LOCAL
+  TRACE_BIND,
+  // queue, buffer, offset, size, chunk size, num_slots (u32),
+  // contents (empty if not sampled), where the chunk size and the
+  // number of slots describe the staging pool, and num_slots is 0
+  // for a direct transfer
+  TRACE_WRITE,
+  // queue, buffer, offset, size, chunk size, num_slots (u32)
+  TRACE_READ,
+  // queue, source, target, source offset, target offset, size
+  TRACE_COPY,
+  // queue, kernel, dims, 3 * global size, has local size (u8),
+  // 3 * local size
+  TRACE_LAUNCH,
+  // queue, flags, num_buffers, num_buffers * buffer
+  TRACE_MIGRATE,
+  // queue
+  TRACE_FINISH,
+  NUM_TRACE_RECORD_TYPES
+};
+
+enum trace_argument_kind {
+  TRACE_ARGUMENT_VALUE,
+  TRACE_ARGUMENT_MEMORY,
+  TRACE_ARGUMENT_LOCAL,
+};
+
+static const char *trace_record_names[NUM_TRACE_RECORD_TYPES] = {
+  "?", "context", "queue", "program", "kernel", "buffer", "release",
+  "bind", "write", "read", "copy", "launch", "migrate", "finish"
+};
+
+struct trace_record_header {
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t size;      // of the payload, which may hold large buffers
+  uint64_t start_ns;  // since the beginning of the capture
+  uint64_t duration_ns;
+};
+
+// A growable buffer for composing the payloads
+
+struct trace_buffer {
+  char *data;
+  size_t size;
+  size_t capacity;
+};
+
+static inline void
+trace_put(struct trace_buffer *buffer, const void *data, size_t size) {
+  if(buffer->size + size > buffer->capacity) {
+    size_t capacity = buffer->capacity ? buffer->capacity : 256;
+    while(capacity < buffer->size + size) {
+      capacity *= 2;
+    }
+    buffer->data = realloc(buffer->data, capacity);
+    buffer->capacity = capacity;
+  }
+  memcpy(buffer->data + buffer->size, data, size);
+  buffer->size += size;
+}
+
+static inline void
+trace_put_u8(struct trace_buffer *buffer, uint8_t value) {
+  trace_put(buffer, &value, sizeof(value));
+}
+
+static inline void
+trace_put_u32(struct trace_buffer *buffer, uint32_t value) {
+  trace_put(buffer, &value, sizeof(value));
+}
+
+static inline void
+trace_put_u64(struct trace_buffer *buffer, uint64_t value) {
+  trace_put(buffer, &value, sizeof(value));
+}
+
+static inline void
+trace_put_blob(struct trace_buffer *buffer, const void *data, size_t size) {
+  trace_put_u64(buffer, size);
+  trace_put(buffer, data, size);
+}
+
+static inline void
+trace_put_string(struct trace_buffer *buffer, const char *string) {
+  trace_put_blob(buffer, string, string ? strlen(string) : 0);
+}
+
+// Reading the payloads; a read past the end of the payload sets
+// the error flag and yields zeros
+
+struct trace_reader {
+  const char *data;
+  size_t size;
+  size_t position;
+  int error;
+};
+
+static inline const void *
+trace_get(struct trace_reader *reader, size_t size) {
+  if(reader->error || size > reader->size - reader->position) {
+    reader->error = 1;
+    return NULL;
+  }
+  const void *data = reader->data + reader->position;
+  reader->position += size;
+  return data;
+}
+
+#define TRACE_GET_(name, type)						\
+  static inline type							\
+  trace_get_##name(struct trace_reader *reader) {			\
+    type value = 0;							\
+    const void *data = trace_get(reader, sizeof(type));			\
+    if(data) {								\
+      memcpy(&value, data, sizeof(type));				\
+    }									\
+    return value;							\
+  }
+
+TRACE_GET_(u8, uint8_t)
+TRACE_GET_(u32, uint32_t)
+TRACE_GET_(u64, uint64_t)
+
+#undef TRACE_GET_
+
+static inline const void *
+trace_get_blob(struct trace_reader *reader, size_t *size) {
+  *size = trace_get_u64(reader);
+  const void *data = trace_get(reader, *size);
+  if(data == NULL) {
+    *size = 0;
+  }
+  return data;
+}
+
+// returns a null-terminated copy that needs to be freed
+static inline char *
+trace_get_string(struct trace_reader *reader) {
+  size_t size;
+  const char *data = trace_get_blob(reader, &size);
+  char *string = malloc(size + 1);
+  if(data) {
+    memcpy(string, data, size);
+  }
+  string[size] = '\0';
+  return string;
+}
+
+#endif // CLOPS_TRACE_H
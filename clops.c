@@ -2,12 +2,18 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <alloca.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 #define CL_TARGET_OPENCL_VERSION 120
 #include <CL/opencl.h>
 
 #include <libguile.h>
 
+#include "clops-trace.h"
+
 #define NELEMS(array) (sizeof(array)/sizeof(array[0]))
 
 #define WARN_(msg, ...) fprintf(stderr, msg, ## __VA_ARGS__)
@@ -26,6 +32,8 @@ static scm_t_bits cl_sampler_tag;
 static scm_t_bits cl_image2d_tag;
 static scm_t_bits cl_image3d_tag;
 static scm_t_bits cl_event_tag;
+static scm_t_bits cl_staging_pool_tag;
+static scm_t_bits cl_tenant_tag;
 
 #define CL_TRY(action) if((action) != CL_SUCCESS) { \
     WARN(# action " failed");			    \
@@ -104,6 +112,293 @@ cl_warn(cl_int result) {
   }
 }
 
+static inline uint64_t
+now_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return ((uint64_t) t.tv_sec) * 1000000000ULL + (uint64_t) t.tv_nsec;
+}
+
+// Counters describing what the bindings do. Every thread owns a slot
+// that only that thread writes to, so updates are plain relaxed stores,
+// and the readers sum the slots of all threads. Kernels and queues have
+// their own records, which are updated with atomic additions.
+
+enum enqueue_call {
+  ENQUEUE_READ,
+  ENQUEUE_WRITE,
+  ENQUEUE_COPY,
+  ENQUEUE_KERNEL,
+  ENQUEUE_MIGRATE,
+  NUM_ENQUEUE_CALLS
+};
+
+static const char *enqueue_call_names[NUM_ENQUEUE_CALLS] = {
+  "read", "write", "copy", "kernel", "migrate"
+};
+
+// the upper bound of the k-th latency bucket is 2^k microseconds,
+// and the last bucket counts everything above that
+#define LATENCY_BUCKETS 20
+
+struct counters {
+  uint64_t builds;
+  uint64_t build_ns;
+  uint64_t buffers_created;
+  uint64_t buffers_released;
+  uint64_t bytes_allocated;
+  uint64_t bytes_released;
+  uint64_t migrations;
+  uint64_t buffers_migrated;
+  uint64_t bytes_migrated;
+  uint64_t bytes_to_host;
+  uint64_t enqueue_ns[NUM_ENQUEUE_CALLS];
+  uint64_t enqueue_latency[NUM_ENQUEUE_CALLS][LATENCY_BUCKETS + 1];
+};
+
+struct counter_slot {
+  struct counter_slot *next;
+  struct counters counters;
+};
+
+static struct counter_slot *counter_slots = NULL;
+static __thread struct counter_slot *local_counter_slot = NULL;
+
+static struct counters *
+local_counters() {
+  if(local_counter_slot == NULL) {
+    struct counter_slot *slot = calloc(1, sizeof(struct counter_slot));
+    slot->next = __atomic_load_n(&counter_slots, __ATOMIC_ACQUIRE);
+    while(!__atomic_compare_exchange_n(&counter_slots, &slot->next, slot,
+				       1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    local_counter_slot = slot;
+  }
+  return &local_counter_slot->counters;
+}
+
+#define COUNT(field, amount) {						\
+    struct counters *counters_ = local_counters();			\
+    __atomic_store_n(&counters_->field, counters_->field + (amount),	\
+		     __ATOMIC_RELAXED);					\
+  }
+
+static void
+count_enqueue(enum enqueue_call call, uint64_t start_ns) {
+  uint64_t ns = now_ns() - start_ns;
+  uint64_t bound = 1000;
+  int bucket = 0;
+  while(bucket < LATENCY_BUCKETS && ns > bound) {
+    bound <<= 1;
+    ++bucket;
+  }
+  COUNT(enqueue_ns[call], ns);
+  COUNT(enqueue_latency[call][bucket], 1);
+}
+
+static void
+sum_counters(struct counters *total) {
+  memset(total, 0, sizeof(struct counters));
+  uint64_t *sum = (uint64_t *) total;
+  for(struct counter_slot *slot
+	= __atomic_load_n(&counter_slots, __ATOMIC_ACQUIRE);
+      slot != NULL;
+      slot = slot->next) {
+    uint64_t *values = (uint64_t *) &slot->counters;
+    for(int i = 0; i < sizeof(struct counters)/sizeof(uint64_t); ++i) {
+      sum[i] += __atomic_load_n(&values[i], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+struct kernel_counters {
+  struct kernel_counters *next;
+  char *name;
+  uint64_t launches;
+};
+
+static struct kernel_counters *kernel_counters = NULL;
+
+// kernels of the same name share their counters
+static struct kernel_counters *
+find_kernel_counters(const char *name) {
+  struct kernel_counters *record = NULL;
+  struct kernel_counters *head
+    = __atomic_load_n(&kernel_counters, __ATOMIC_ACQUIRE);
+  while(1) {
+    for(struct kernel_counters *k = head; k != NULL; k = k->next) {
+      if(!strcmp(k->name, name)) {
+	if(record) {
+	  free(record->name);
+	  free(record);
+	}
+	return k;
+      }
+    }
+    if(record == NULL) {
+      record = calloc(1, sizeof(struct kernel_counters));
+      record->name = strdup(name);
+    }
+    record->next = head;
+    if(__atomic_compare_exchange_n(&kernel_counters, &head, record,
+				   0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+      return record;
+    }
+    // someone else has added a kernel in the meantime
+  }
+}
+
+struct queue_counters {
+  struct queue_counters *next;
+  int id;
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t bytes_copied;
+};
+
+static struct queue_counters *queue_counters = NULL;
+static int num_queues = 0;
+
+static struct queue_counters *
+new_queue_counters() {
+  struct queue_counters *record = calloc(1, sizeof(struct queue_counters));
+  record->id = __atomic_fetch_add(&num_queues, 1, __ATOMIC_RELAXED);
+  record->next = __atomic_load_n(&queue_counters, __ATOMIC_ACQUIRE);
+  while(!__atomic_compare_exchange_n(&queue_counters, &record->next, record,
+				     1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+  return record;
+}
+
+#define QUEUE_COUNTERS(queue) \
+  ((struct queue_counters *) SCM_SMOB_DATA_2(queue))
+
+#define KERNEL_COUNTERS(kernel) \
+  ((struct kernel_counters *) SCM_SMOB_DATA_3(kernel))
+
+// In the capture mode, the calls that create OpenCL objects and enqueue
+// commands are logged to a trace file in the format described in
+// clops-trace.h, which can be re-executed with clops-replay. The capture
+// should be started before the context is created, so that the trace
+// contains all the objects that it refers to.
+
+static FILE *capture_file = NULL;
+static uint64_t capture_start_ns = 0;
+static uint64_t capture_sample_every = 0; // 0 means that contents aren't kept
+static uint64_t capture_num_transfers = 0;
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define CAPTURING (__atomic_load_n(&capture_file, __ATOMIC_RELAXED) != NULL)
+
+#define TRACE_ID(handle) ((uint64_t) (uintptr_t) (handle))
+
+// decides whether the contents of the current transfer are recorded
+static int
+capture_contents() {
+  uint64_t every = __atomic_load_n(&capture_sample_every, __ATOMIC_RELAXED);
+  return every > 0
+    && __atomic_fetch_add(&capture_num_transfers, 1, __ATOMIC_RELAXED)
+    % every == 0;
+}
+
+static void
+capture(enum trace_record_type type, uint64_t start_ns,
+	struct trace_buffer *payload) {
+  uint64_t end_ns = now_ns();
+  pthread_mutex_lock(&capture_mutex);
+  if(capture_file) {
+    struct trace_record_header header = {
+      .type = type,
+      .size = payload->size,
+      .start_ns = start_ns > capture_start_ns
+        ? start_ns - capture_start_ns : 0,
+      .duration_ns = end_ns - start_ns,
+    };
+    if(fwrite(&header, sizeof(header), 1, capture_file) != 1
+       || (payload->size > 0
+	   && fwrite(payload->data, payload->size, 1, capture_file) != 1)) {
+      WARN("Failed to write the trace, stopping the capture");
+      fclose(capture_file);
+      __atomic_store_n(&capture_file, NULL, __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_unlock(&capture_mutex);
+  free(payload->data);
+}
+
+static void
+capture_device(struct trace_buffer *payload, cl_device_id device) {
+  cl_device_type type = 0;
+  size_t size = 0;
+  clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+  clGetDeviceInfo(device, CL_DEVICE_NAME, 0, NULL, &size);
+  char *name = alloca(size + 1);
+  name[0] = '\0';
+  clGetDeviceInfo(device, CL_DEVICE_NAME, size, name, NULL);
+  name[size] = '\0';
+  trace_put_u64(payload, TRACE_ID(device));
+  trace_put_u64(payload, type);
+  trace_put_string(payload, name);
+}
+
+static void
+capture_launch(cl_command_queue queue, cl_kernel kernel, cl_uint dims,
+	       const size_t *global_work_size, const size_t *local_work_size,
+	       uint64_t start_ns) {
+  struct trace_buffer payload = { NULL, 0, 0 };
+  trace_put_u64(&payload, TRACE_ID(queue));
+  trace_put_u64(&payload, TRACE_ID(kernel));
+  trace_put_u32(&payload, dims);
+  for(int i = 0; i < 3; ++i) {
+    trace_put_u64(&payload, i < dims ? global_work_size[i] : 1);
+  }
+  trace_put_u8(&payload, local_work_size != NULL);
+  for(int i = 0; i < 3; ++i) {
+    trace_put_u64(&payload, local_work_size && i < dims
+		  ? local_work_size[i] : 1);
+  }
+  capture(TRACE_LAUNCH, start_ns, &payload);
+}
+
+static SCM
+start_capture_x(SCM s_path, SCM s_sample_every) {
+  char *path = scm_to_locale_string(s_path);
+  uint64_t sample_every = SCM_UNBNDP(s_sample_every)
+    ? 0 : scm_to_uint64(s_sample_every);
+  FILE *file = fopen(path, "wb");
+  if(file == NULL) {
+    WARN("Failed to open %s for writing", path);
+    free(path);
+    return SCM_BOOL_F;
+  }
+  free(path);
+  struct trace_header header = {
+    .magic = TRACE_MAGIC,
+    .version = TRACE_VERSION,
+    .flags = 0,
+  };
+  fwrite(&header, sizeof(header), 1, file);
+  pthread_mutex_lock(&capture_mutex);
+  if(capture_file) {
+    fclose(capture_file);
+  }
+  capture_start_ns = now_ns();
+  capture_sample_every = sample_every;
+  capture_num_transfers = 0;
+  __atomic_store_n(&capture_file, file, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&capture_mutex);
+  return SCM_BOOL_T;
+}
+
+static SCM
+stop_capture_x() {
+  pthread_mutex_lock(&capture_mutex);
+  if(capture_file) {
+    fclose(capture_file);
+    __atomic_store_n(&capture_file, NULL, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&capture_mutex);
+  return SCM_UNSPECIFIED;
+}
+
 static SCM
 platform_smob(cl_platform_id platform_id) {
   assert(sizeof(scm_t_bits) == sizeof(cl_platform_id));
@@ -322,6 +617,357 @@ devices(SCM platform, SCM types) {
   return result;
 }
 
+// The *-info functions below return the values of OpenCL queries
+// converted to Scheme, without any limits on their length.
+
+enum info_type {
+  INFO_STRING,
+  INFO_WORDS,  // space separated list, such as extensions
+  INFO_NAMES,  // semicolon separated list, such as kernel names
+  INFO_BOOL,
+  INFO_UINT,
+  INFO_ULONG,
+  INFO_SIZE,
+  INFO_SIZES,
+  INFO_BITFIELD,
+  INFO_DEVICE_TYPE,
+  INFO_DEVICES,
+  INFO_BUILD_STATUS,
+};
+
+struct info_param {
+  const char *name;
+  cl_uint param;
+  enum info_type type;
+};
+
+static const struct info_param platform_params[] = {
+  { "profile", CL_PLATFORM_PROFILE, INFO_STRING },
+  { "version", CL_PLATFORM_VERSION, INFO_STRING },
+  { "name", CL_PLATFORM_NAME, INFO_STRING },
+  { "vendor", CL_PLATFORM_VENDOR, INFO_STRING },
+  { "extensions", CL_PLATFORM_EXTENSIONS, INFO_WORDS },
+};
+
+static const struct info_param device_params[] = {
+  { "type", CL_DEVICE_TYPE, INFO_DEVICE_TYPE },
+  { "vendor-id", CL_DEVICE_VENDOR_ID, INFO_UINT },
+  { "max-compute-units", CL_DEVICE_MAX_COMPUTE_UNITS, INFO_UINT },
+  { "max-work-item-dimensions", CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS,
+    INFO_UINT },
+  { "max-work-item-sizes", CL_DEVICE_MAX_WORK_ITEM_SIZES, INFO_SIZES },
+  { "max-work-group-size", CL_DEVICE_MAX_WORK_GROUP_SIZE, INFO_SIZE },
+  { "preferred-vector-width-char", CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR,
+    INFO_UINT },
+  { "preferred-vector-width-short", CL_DEVICE_PREFERRED_VECTOR_WIDTH_SHORT,
+    INFO_UINT },
+  { "preferred-vector-width-int", CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT,
+    INFO_UINT },
+  { "preferred-vector-width-long", CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG,
+    INFO_UINT },
+  { "preferred-vector-width-float", CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT,
+    INFO_UINT },
+  { "preferred-vector-width-double", CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE,
+    INFO_UINT },
+  { "preferred-vector-width-half", CL_DEVICE_PREFERRED_VECTOR_WIDTH_HALF,
+    INFO_UINT },
+  { "native-vector-width-char", CL_DEVICE_NATIVE_VECTOR_WIDTH_CHAR,
+    INFO_UINT },
+  { "native-vector-width-short", CL_DEVICE_NATIVE_VECTOR_WIDTH_SHORT,
+    INFO_UINT },
+  { "native-vector-width-int", CL_DEVICE_NATIVE_VECTOR_WIDTH_INT,
+    INFO_UINT },
+  { "native-vector-width-long", CL_DEVICE_NATIVE_VECTOR_WIDTH_LONG,
+    INFO_UINT },
+  { "native-vector-width-float", CL_DEVICE_NATIVE_VECTOR_WIDTH_FLOAT,
+    INFO_UINT },
+  { "native-vector-width-double", CL_DEVICE_NATIVE_VECTOR_WIDTH_DOUBLE,
+    INFO_UINT },
+  { "native-vector-width-half", CL_DEVICE_NATIVE_VECTOR_WIDTH_HALF,
+    INFO_UINT },
+  { "max-clock-frequency", CL_DEVICE_MAX_CLOCK_FREQUENCY, INFO_UINT },
+  { "address-bits", CL_DEVICE_ADDRESS_BITS, INFO_UINT },
+  { "max-mem-alloc-size", CL_DEVICE_MAX_MEM_ALLOC_SIZE, INFO_ULONG },
+  { "image-support", CL_DEVICE_IMAGE_SUPPORT, INFO_BOOL },
+  { "max-read-image-args", CL_DEVICE_MAX_READ_IMAGE_ARGS, INFO_UINT },
+  { "max-write-image-args", CL_DEVICE_MAX_WRITE_IMAGE_ARGS, INFO_UINT },
+  { "image2d-max-width", CL_DEVICE_IMAGE2D_MAX_WIDTH, INFO_SIZE },
+  { "image2d-max-height", CL_DEVICE_IMAGE2D_MAX_HEIGHT, INFO_SIZE },
+  { "image3d-max-width", CL_DEVICE_IMAGE3D_MAX_WIDTH, INFO_SIZE },
+  { "image3d-max-height", CL_DEVICE_IMAGE3D_MAX_HEIGHT, INFO_SIZE },
+  { "image3d-max-depth", CL_DEVICE_IMAGE3D_MAX_DEPTH, INFO_SIZE },
+  { "image-max-buffer-size", CL_DEVICE_IMAGE_MAX_BUFFER_SIZE, INFO_SIZE },
+  { "image-max-array-size", CL_DEVICE_IMAGE_MAX_ARRAY_SIZE, INFO_SIZE },
+  { "max-samplers", CL_DEVICE_MAX_SAMPLERS, INFO_UINT },
+  { "max-parameter-size", CL_DEVICE_MAX_PARAMETER_SIZE, INFO_SIZE },
+  { "mem-base-addr-align", CL_DEVICE_MEM_BASE_ADDR_ALIGN, INFO_UINT },
+  { "single-fp-config", CL_DEVICE_SINGLE_FP_CONFIG, INFO_BITFIELD },
+  { "double-fp-config", CL_DEVICE_DOUBLE_FP_CONFIG, INFO_BITFIELD },
+  { "global-mem-cache-type", CL_DEVICE_GLOBAL_MEM_CACHE_TYPE, INFO_UINT },
+  { "global-mem-cacheline-size", CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE,
+    INFO_UINT },
+  { "global-mem-cache-size", CL_DEVICE_GLOBAL_MEM_CACHE_SIZE, INFO_ULONG },
+  { "global-mem-size", CL_DEVICE_GLOBAL_MEM_SIZE, INFO_ULONG },
+  { "max-constant-buffer-size", CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE,
+    INFO_ULONG },
+  { "max-constant-args", CL_DEVICE_MAX_CONSTANT_ARGS, INFO_UINT },
+  { "local-mem-type", CL_DEVICE_LOCAL_MEM_TYPE, INFO_UINT },
+  { "local-mem-size", CL_DEVICE_LOCAL_MEM_SIZE, INFO_ULONG },
+  { "error-correction-support", CL_DEVICE_ERROR_CORRECTION_SUPPORT,
+    INFO_BOOL },
+  { "host-unified-memory", CL_DEVICE_HOST_UNIFIED_MEMORY, INFO_BOOL },
+  { "profiling-timer-resolution", CL_DEVICE_PROFILING_TIMER_RESOLUTION,
+    INFO_SIZE },
+  { "endian-little", CL_DEVICE_ENDIAN_LITTLE, INFO_BOOL },
+  { "available", CL_DEVICE_AVAILABLE, INFO_BOOL },
+  { "compiler-available", CL_DEVICE_COMPILER_AVAILABLE, INFO_BOOL },
+  { "linker-available", CL_DEVICE_LINKER_AVAILABLE, INFO_BOOL },
+  { "execution-capabilities", CL_DEVICE_EXECUTION_CAPABILITIES,
+    INFO_BITFIELD },
+  { "queue-properties", CL_DEVICE_QUEUE_PROPERTIES, INFO_BITFIELD },
+  { "built-in-kernels", CL_DEVICE_BUILT_IN_KERNELS, INFO_NAMES },
+  { "name", CL_DEVICE_NAME, INFO_STRING },
+  { "vendor", CL_DEVICE_VENDOR, INFO_STRING },
+  { "driver-version", CL_DRIVER_VERSION, INFO_STRING },
+  { "profile", CL_DEVICE_PROFILE, INFO_STRING },
+  { "version", CL_DEVICE_VERSION, INFO_STRING },
+  { "opencl-c-version", CL_DEVICE_OPENCL_C_VERSION, INFO_STRING },
+  { "extensions", CL_DEVICE_EXTENSIONS, INFO_WORDS },
+  { "printf-buffer-size", CL_DEVICE_PRINTF_BUFFER_SIZE, INFO_SIZE },
+  { "preferred-interop-user-sync", CL_DEVICE_PREFERRED_INTEROP_USER_SYNC,
+    INFO_BOOL },
+  { "partition-max-sub-devices", CL_DEVICE_PARTITION_MAX_SUB_DEVICES,
+    INFO_UINT },
+};
+
+static const struct info_param kernel_work_group_params[] = {
+  { "work-group-size", CL_KERNEL_WORK_GROUP_SIZE, INFO_SIZE },
+  { "compile-work-group-size", CL_KERNEL_COMPILE_WORK_GROUP_SIZE,
+    INFO_SIZES },
+  { "local-mem-size", CL_KERNEL_LOCAL_MEM_SIZE, INFO_ULONG },
+  { "preferred-work-group-size-multiple",
+    CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, INFO_SIZE },
+  { "private-mem-size", CL_KERNEL_PRIVATE_MEM_SIZE, INFO_ULONG },
+  { "global-work-size", CL_KERNEL_GLOBAL_WORK_SIZE, INFO_SIZES },
+};
+
+static const struct info_param program_params[] = {
+  { "reference-count", CL_PROGRAM_REFERENCE_COUNT, INFO_UINT },
+  { "num-devices", CL_PROGRAM_NUM_DEVICES, INFO_UINT },
+  { "devices", CL_PROGRAM_DEVICES, INFO_DEVICES },
+  { "source", CL_PROGRAM_SOURCE, INFO_STRING },
+  { "binary-sizes", CL_PROGRAM_BINARY_SIZES, INFO_SIZES },
+  { "num-kernels", CL_PROGRAM_NUM_KERNELS, INFO_SIZE },
+  { "kernel-names", CL_PROGRAM_KERNEL_NAMES, INFO_NAMES },
+};
+
+static const struct info_param program_build_params[] = {
+  { "build-status", CL_PROGRAM_BUILD_STATUS, INFO_BUILD_STATUS },
+  { "build-options", CL_PROGRAM_BUILD_OPTIONS, INFO_STRING },
+  { "build-log", CL_PROGRAM_BUILD_LOG, INFO_STRING },
+};
+
+static const struct info_param *
+find_info_param(const struct info_param *params, size_t num_params,
+		SCM symbol) {
+  const struct info_param *found = NULL;
+  char *name = scm_to_locale_string(scm_symbol_to_string(symbol));
+  for(int i = 0; i < num_params; ++i) {
+    if(!strcasecmp(params[i].name, name)) {
+      found = &params[i];
+      break;
+    }
+  }
+  free(name);
+  return found;
+}
+
+static SCM
+split_string(const char *string, size_t length, char separator) {
+  SCM result = SCM_EOL;
+  size_t start = 0;
+  for(size_t i = 0; i <= length; ++i) {
+    if(i == length || string[i] == separator || string[i] == '\0') {
+      if(i > start) {
+	result = scm_cons(scm_from_locale_stringn(string + start, i - start),
+			  result);
+      }
+      start = i + 1;
+      if(i < length && string[i] == '\0') {
+	break;
+      }
+    }
+  }
+  return scm_reverse_x(result, SCM_EOL);
+}
+
+static SCM
+info_value(const void *data, size_t size, enum info_type type) {
+  switch(type) {
+  case INFO_STRING:
+    // the returned strings are null-terminated
+    return scm_from_locale_stringn((const char *) data,
+				   size > 0 ? strnlen(data, size) : 0);
+  case INFO_WORDS:
+    return split_string((const char *) data, size, ' ');
+  case INFO_NAMES:
+    return split_string((const char *) data, size, ';');
+  case INFO_BOOL:
+    return scm_from_bool(*((const cl_bool *) data));
+  case INFO_UINT:
+    return scm_from_uint32(*((const cl_uint *) data));
+  case INFO_ULONG:
+  case INFO_BITFIELD:
+    return scm_from_uint64(*((const cl_ulong *) data));
+  case INFO_SIZE:
+    return scm_from_size_t(*((const size_t *) data));
+  case INFO_SIZES: {
+    const size_t *sizes = (const size_t *) data;
+    SCM result = SCM_EOL;
+    for(int i = size / sizeof(size_t) - 1; i >= 0; --i) {
+      result = scm_cons(scm_from_size_t(sizes[i]), result);
+    }
+    return result;
+  }
+  case INFO_DEVICE_TYPE: {
+    cl_device_type device_type = *((const cl_device_type *) data);
+    SCM result = SCM_EOL;
+    if(device_type & CL_DEVICE_TYPE_CUSTOM) {
+      result = scm_cons(scm_from_latin1_symbol("CUSTOM"), result);
+    }
+    if(device_type & CL_DEVICE_TYPE_ACCELERATOR) {
+      result = scm_cons(scm_from_latin1_symbol("ACCELERATOR"), result);
+    }
+    if(device_type & CL_DEVICE_TYPE_CPU) {
+      result = scm_cons(scm_from_latin1_symbol("CPU"), result);
+    }
+    if(device_type & CL_DEVICE_TYPE_GPU) {
+      result = scm_cons(scm_from_latin1_symbol("GPU"), result);
+    }
+    if(device_type & CL_DEVICE_TYPE_DEFAULT) {
+      result = scm_cons(scm_from_latin1_symbol("DEFAULT"), result);
+    }
+    return result;
+  }
+  case INFO_DEVICES: {
+    const cl_device_id *devices = (const cl_device_id *) data;
+    SCM result = SCM_EOL;
+    for(int i = size / sizeof(cl_device_id) - 1; i >= 0; --i) {
+      cl_platform_id platform_id = NULL;
+      clGetDeviceInfo(devices[i], CL_DEVICE_PLATFORM,
+		      sizeof(platform_id), &platform_id, NULL);
+      result = scm_cons(device_smob(devices[i], platform_id), result);
+    }
+    return result;
+  }
+  case INFO_BUILD_STATUS:
+    switch(*((const cl_build_status *) data)) {
+    case CL_BUILD_SUCCESS:
+      return scm_from_latin1_symbol("success");
+    case CL_BUILD_ERROR:
+      return scm_from_latin1_symbol("error");
+    case CL_BUILD_IN_PROGRESS:
+      return scm_from_latin1_symbol("in-progress");
+    case CL_BUILD_NONE:
+    default:
+      return scm_from_latin1_symbol("none");
+    }
+  default:
+    WARN("Unsupported info type: %d", type);
+    return SCM_BOOL_F;
+  }
+}
+
+// Each query function is called twice: first to learn the size
+// of the result, and then to fill a buffer of that size. Results
+// such as program sources can be large, so only the small ones
+// are kept on the stack.
+#define INFO_QUERY(result, param, query, ...) {				\
+    size_t size_;							\
+    cl_int status_ = query(__VA_ARGS__, 0, NULL, &size_);		\
+    if(status_ == CL_SUCCESS) {						\
+      char small_[256];							\
+      void *data_ = size_ < sizeof(small_) ? small_ : malloc(size_ + 1); \
+      status_ = query(__VA_ARGS__, size_, data_, NULL);			\
+      if(status_ == CL_SUCCESS) {					\
+	result = info_value(data_, size_, param->type);			\
+      }									\
+      if(data_ != small_) {						\
+	free(data_);							\
+      }									\
+    }									\
+    if(status_ != CL_SUCCESS) {						\
+      WARN_(# query "(%s) failed: ", param->name);			\
+      cl_warn(status_);							\
+    }									\
+  }
+
+static SCM
+platform_info(SCM platform, SCM symbol) {
+  scm_assert_smob_type(cl_platform_tag, platform);
+  cl_platform_id platform_id = (cl_platform_id) SCM_SMOB_DATA(platform);
+  if(SCM_UNBNDP(symbol)) {
+    SCM result = SCM_EOL;
+    for(int i = NELEMS(platform_params) - 1; i >= 0; --i) {
+      SCM name = scm_from_latin1_symbol(platform_params[i].name);
+      result = scm_acons(name, platform_info(platform, name), result);
+    }
+    return result;
+  }
+  const struct info_param *param
+    = find_info_param(platform_params, NELEMS(platform_params), symbol);
+  SCM result = SCM_BOOL_F;
+  if(param == NULL) {
+    WARN("Unsupported platform parameter");
+    return result;
+  }
+  INFO_QUERY(result, param, clGetPlatformInfo, platform_id, param->param);
+  return result;
+}
+
+// the properties of a device, except for its availability, never
+// change, so they are cached in a table of parameters for each device id
+static SCM device_info_cache = SCM_BOOL_F;
+
+static SCM
+device_info(SCM device, SCM symbol) {
+  scm_assert_smob_type(cl_device_tag, device);
+  cl_device_id device_id = (cl_device_id) SCM_SMOB_DATA(device);
+  if(SCM_UNBNDP(symbol)) {
+    SCM result = SCM_EOL;
+    for(int i = NELEMS(device_params) - 1; i >= 0; --i) {
+      SCM name = scm_from_latin1_symbol(device_params[i].name);
+      result = scm_acons(name, device_info(device, name), result);
+    }
+    return result;
+  }
+  const struct info_param *param
+    = find_info_param(device_params, NELEMS(device_params), symbol);
+  SCM result = SCM_BOOL_F;
+  if(param == NULL) {
+    WARN("Unsupported device parameter");
+    return result;
+  }
+  SCM cache = SCM_BOOL_F;
+  if(param->param != CL_DEVICE_AVAILABLE) {
+    SCM key = scm_from_uintptr_t((uintptr_t) device_id);
+    cache = scm_hashv_ref(device_info_cache, key, SCM_BOOL_F);
+    if(scm_is_false(cache)) {
+      cache = scm_c_make_hash_table(NELEMS(device_params));
+      scm_hashv_set_x(device_info_cache, key, cache);
+    }
+    SCM cached = scm_hashq_ref(cache, symbol, SCM_UNDEFINED);
+    if(!SCM_UNBNDP(cached)) {
+      return cached;
+    }
+  }
+  INFO_QUERY(result, param, clGetDeviceInfo, device_id, param->param);
+  if(scm_is_true(cache)) {
+    scm_hashq_set_x(cache, symbol, result);
+  }
+  return result;
+}
+
 static void
 on_error_in_context(const char *errinfo, const void *private_info,
 		    size_t cb, void *user_data)
@@ -396,6 +1042,15 @@ create_context(SCM device_smobs) {
 				 on_error_in_context, NULL, &result);
   if(result == CL_SUCCESS) {
     context_smob = scm_new_smob(cl_context_tag, (scm_t_bits) c);
+    if(CAPTURING) {
+      struct trace_buffer payload = { NULL, 0, 0 };
+      trace_put_u64(&payload, TRACE_ID(c));
+      trace_put_u32(&payload, num_devices);
+      for(int i = 0; i < num_devices; ++i) {
+	capture_device(&payload, devices[i]);
+      }
+      capture(TRACE_CONTEXT, now_ns(), &payload);
+    }
   }
   else {
     WARN("Failed to create context (0x%x)", result);
@@ -446,7 +1101,17 @@ create_command_queue(SCM device, SCM properties) {
   cl_int result;
   cl_command_queue q = clCreateCommandQueue(context, device_id, props, &result);
   if(result == CL_SUCCESS) {
-    queue = scm_new_smob(cl_command_queue_tag, (scm_t_bits) q);
+    queue = scm_new_double_smob(cl_command_queue_tag, (scm_t_bits) q,
+				(scm_t_bits) new_queue_counters(),
+				(scm_t_bits) NULL);
+    if(CAPTURING) {
+      struct trace_buffer payload = { NULL, 0, 0 };
+      trace_put_u64(&payload, TRACE_ID(q));
+      trace_put_u64(&payload, TRACE_ID(context));
+      trace_put_u64(&payload, TRACE_ID(device_id));
+      trace_put_u64(&payload, props);
+      capture(TRACE_QUEUE, now_ns(), &payload);
+    }
   }
   else {
     WARN("Failed to create command queue (0x%x)", result);
@@ -456,6 +1121,23 @@ create_command_queue(SCM device, SCM properties) {
   return queue;
 }
 
+static int
+queue_smob_print(SCM queue, SCM port, scm_print_state *unused) {
+  char buffer[16];
+  scm_puts("#<OpenCL command queue ", port);
+  snprintf(buffer, sizeof(buffer), "%d", QUEUE_COUNTERS(queue)->id);
+  scm_puts(buffer, port);
+  scm_puts(">", port);
+  return 1;
+}
+
+// the key under which (cl-counters) reports this queue
+static SCM
+queue_id(SCM queue) {
+  scm_assert_smob_type(cl_command_queue_tag, queue);
+  return scm_from_int(QUEUE_COUNTERS(queue)->id);
+}
+
 
 
 static SCM
@@ -480,10 +1162,26 @@ create_program(SCM source, SCM devices) {
 	device_ids[i] = (cl_device_id) SCM_SMOB_DATA(dev);
       }
     }
+    uint64_t start = now_ns();
     result = clBuildProgram(handle, num_devices, device_ids,
 			    current_build_options,
 			    (void (*)(cl_program, void *)) NULL,
 			    NULL);
+    COUNT(build_ns, now_ns() - start);
+    COUNT(builds, 1);
+    if(CAPTURING) {
+      struct trace_buffer payload = { NULL, 0, 0 };
+      trace_put_u64(&payload, TRACE_ID(handle));
+      trace_put_u64(&payload, TRACE_ID(context));
+      trace_put_u32(&payload, num_devices);
+      for(int i = 0; i < num_devices; ++i) {
+	trace_put_u64(&payload, TRACE_ID(device_ids[i]));
+      }
+      trace_put_string(&payload, src);
+      trace_put_string(&payload, current_build_options);
+      trace_put_u32(&payload, (uint32_t) result);
+      capture(TRACE_PROGRAM, start, &payload);
+    }
     if(result != CL_SUCCESS) {
       WARN("Failed to build program (0x%x)", result); 
     }
@@ -496,6 +1194,56 @@ create_program(SCM source, SCM devices) {
   return program;
 }
 
+static SCM
+program_info(SCM program, SCM symbol, SCM device) {
+  scm_assert_smob_type(cl_program_tag, program);
+  cl_program program_id = (cl_program) SCM_SMOB_DATA(program);
+  cl_device_id device_id = NULL;
+  if(!SCM_UNBNDP(device)) {
+    scm_assert_smob_type(cl_device_tag, device);
+    device_id = (cl_device_id) SCM_SMOB_DATA(device);
+  }
+  if(SCM_UNBNDP(symbol)) {
+    SCM result = SCM_EOL;
+    for(int i = NELEMS(program_params) - 1; i >= 0; --i) {
+      SCM name = scm_from_latin1_symbol(program_params[i].name);
+      result = scm_acons(name, program_info(program, name, device), result);
+    }
+    return result;
+  }
+  SCM result = SCM_BOOL_F;
+  const struct info_param *param
+    = find_info_param(program_params, NELEMS(program_params), symbol);
+  if(param != NULL) {
+    INFO_QUERY(result, param, clGetProgramInfo, program_id, param->param);
+    return result;
+  }
+  param = find_info_param(program_build_params,
+			  NELEMS(program_build_params), symbol);
+  if(param == NULL) {
+    WARN("Unsupported program parameter");
+    return result;
+  }
+  if(device_id == NULL) {
+    // if no device was given, the build of the first one is reported
+    cl_uint num_devices;
+    CL_TRY(clGetProgramInfo(program_id, CL_PROGRAM_NUM_DEVICES,
+			    sizeof(num_devices), &num_devices, NULL));
+    if(num_devices == 0) {
+      WARN("The program has no devices");
+      return result;
+    }
+    cl_device_id *devices = alloca(num_devices * sizeof(cl_device_id));
+    CL_TRY(clGetProgramInfo(program_id, CL_PROGRAM_DEVICES,
+			    num_devices * sizeof(cl_device_id), devices,
+			    NULL));
+    device_id = devices[0];
+  }
+  INFO_QUERY(result, param, clGetProgramBuildInfo, program_id, device_id,
+	     param->param);
+  return result;
+}
+
 static SCM
 kernel(SCM program, SCM name) {
   assert(sizeof(cl_kernel) == sizeof(scm_t_bits));
@@ -509,7 +1257,14 @@ kernel(SCM program, SCM name) {
     kernel = scm_new_double_smob(cl_kernel_tag,
 				 (scm_t_bits) kernel_id,
 				 (scm_t_bits) fname,
-				 (scm_t_bits) NULL);
+				 (scm_t_bits) find_kernel_counters(fname));
+    if(CAPTURING) {
+      struct trace_buffer payload = { NULL, 0, 0 };
+      trace_put_u64(&payload, TRACE_ID(kernel_id));
+      trace_put_u64(&payload, TRACE_ID(program_id));
+      trace_put_string(&payload, fname);
+      capture(TRACE_KERNEL, now_ns(), &payload);
+    }
   }
   else {
     WARN("Failed to create kernel %s for program %llx: 0x%x", fname,
@@ -520,6 +1275,39 @@ kernel(SCM program, SCM name) {
   return kernel;
 }
 
+static SCM
+kernel_work_group_info(SCM kernel, SCM symbol, SCM device) {
+  scm_assert_smob_type(cl_kernel_tag, kernel);
+  cl_kernel kernel_id = (cl_kernel) SCM_SMOB_DATA(kernel);
+  cl_device_id device_id = NULL;
+  if(!SCM_UNBNDP(device)) {
+    scm_assert_smob_type(cl_device_tag, device);
+    device_id = (cl_device_id) SCM_SMOB_DATA(device);
+  }
+  if(SCM_UNBNDP(symbol)) {
+    SCM result = SCM_EOL;
+    // the global work size is only defined for custom devices
+    // and built-in kernels, so it is omitted here
+    for(int i = NELEMS(kernel_work_group_params) - 2; i >= 0; --i) {
+      SCM name = scm_from_latin1_symbol(kernel_work_group_params[i].name);
+      result = scm_acons(name, kernel_work_group_info(kernel, name, device),
+			 result);
+    }
+    return result;
+  }
+  const struct info_param *param
+    = find_info_param(kernel_work_group_params,
+		      NELEMS(kernel_work_group_params), symbol);
+  SCM result = SCM_BOOL_F;
+  if(param == NULL) {
+    WARN("Unsupported kernel work group parameter");
+    return result;
+  }
+  INFO_QUERY(result, param, clGetKernelWorkGroupInfo, kernel_id, device_id,
+	     param->param);
+  return result;
+}
+
 static int
 kernel_smob_print(SCM kernel, SCM port, scm_print_state *unused) {
   char *name = (char *) SCM_SMOB_DATA_2(kernel);
@@ -581,6 +1369,17 @@ cl_mem_flags parse_mem_flags(SCM symbols) {
 }
 
 
+// the scheduler may still hold a buffer whose smob has been collected,
+// so the release is recorded when the last reference goes away
+static void CL_CALLBACK
+on_buffer_destroyed(cl_mem mem, void *unused) {
+  if(CAPTURING) {
+    struct trace_buffer payload = { NULL, 0, 0 };
+    trace_put_u64(&payload, TRACE_ID(mem));
+    capture(TRACE_RELEASE_BUFFER, now_ns(), &payload);
+  }
+}
+
 static SCM
 create_buffer(SCM source, SCM options) {
   assert(sizeof(cl_mem) == sizeof(scm_t_bits));
@@ -612,6 +1411,21 @@ create_buffer(SCM source, SCM options) {
 				      (scm_t_bits) buffer,
 				      (scm_t_bits) size,
 				      (scm_t_bits) host_ptr);
+    clSetMemObjectDestructorCallback(buffer, on_buffer_destroyed, NULL);
+    COUNT(buffers_created, 1);
+    COUNT(bytes_allocated, size);
+    if(CAPTURING) {
+      struct trace_buffer payload = { NULL, 0, 0 };
+      int initialized = host_ptr
+	&& (flags & (CL_MEM_USE_HOST_PTR | CL_MEM_COPY_HOST_PTR));
+      trace_put_u64(&payload, TRACE_ID(buffer));
+      trace_put_u64(&payload, TRACE_ID(context));
+      trace_put_u64(&payload, flags);
+      trace_put_u64(&payload, size);
+      trace_put_blob(&payload, host_ptr,
+		     initialized && capture_contents() ? size : 0);
+      capture(TRACE_BUFFER, now_ns(), &payload);
+    }
   }
   else {
     WARN_("Failed to initialize buffer of size %d: ", size);
@@ -621,25 +1435,210 @@ create_buffer(SCM source, SCM options) {
   return buffer_smob;
 }
 
+struct scalar_type {
+  const char *name;
+  size_t size;
+  char kind; // 'i' for signed, 'u' for unsigned and 'f' for floating point
+};
+
+static const struct scalar_type scalar_types[] = {
+  { "char", 1, 'i' },
+  { "uchar", 1, 'u' },
+  { "short", 2, 'i' },
+  { "ushort", 2, 'u' },
+  { "int", 4, 'i' },
+  { "uint", 4, 'u' },
+  { "long", 8, 'i' },
+  { "ulong", 8, 'u' },
+  { "float", 4, 'f' },
+  { "double", 8, 'f' },
+};
+
+static void
+pack_scalar(const struct scalar_type *type, SCM value, char *target) {
+  switch(type->kind) {
+  case 'i': {
+    int64_t x = scm_to_int64(value);
+    switch(type->size) {
+    case 1: { int8_t y = x; memcpy(target, &y, 1); break; }
+    case 2: { int16_t y = x; memcpy(target, &y, 2); break; }
+    case 4: { int32_t y = x; memcpy(target, &y, 4); break; }
+    case 8: memcpy(target, &x, 8); break;
+    }
+    break;
+  }
+  case 'u': {
+    uint64_t x = scm_to_uint64(value);
+    switch(type->size) {
+    case 1: { uint8_t y = x; memcpy(target, &y, 1); break; }
+    case 2: { uint16_t y = x; memcpy(target, &y, 2); break; }
+    case 4: { uint32_t y = x; memcpy(target, &y, 4); break; }
+    case 8: memcpy(target, &x, 8); break;
+    }
+    break;
+  }
+  case 'f':
+    if(type->size == sizeof(cl_float)) {
+      cl_float y = scm_to_double(value);
+      memcpy(target, &y, sizeof(y));
+    }
+    else {
+      cl_double y = scm_to_double(value);
+      memcpy(target, &y, sizeof(y));
+    }
+    break;
+  }
+}
+
+struct kernel_argument {
+  size_t size;
+  const void *value; // NULL for local memory
+  cl_mem memory; // the memory object, if the argument is one
+  char data[16 * sizeof(cl_double)];
+};
+
+// Packs a value of an OpenCL C type, such as int or float4,
+// whose elements are given as a list or a vector.
+static int
+pack_typed_value(const char *type_name, SCM value,
+		 struct kernel_argument *argument) {
+  size_t length = strlen(type_name);
+  size_t digits = length;
+  while(digits > 0 && '0' <= type_name[digits - 1]
+	&& type_name[digits - 1] <= '9') {
+    --digits;
+  }
+  int width = digits == length ? 1 : atoi(type_name + digits);
+  if(width != 1 && width != 2 && width != 3 && width != 4
+     && width != 8 && width != 16) {
+    return 0;
+  }
+  const struct scalar_type *type = NULL;
+  for(int i = 0; i < NELEMS(scalar_types); ++i) {
+    if(strlen(scalar_types[i].name) == digits
+       && !strncasecmp(scalar_types[i].name, type_name, digits)) {
+      type = &scalar_types[i];
+      break;
+    }
+  }
+  if(type == NULL) {
+    return 0;
+  }
+  if(width == 1) {
+    pack_scalar(type, value, argument->data);
+    argument->size = type->size;
+  }
+  else {
+    if(scm_is_vector(value)) {
+      value = scm_vector_to_list(value);
+    }
+    if(scm_to_int(scm_length(value)) != width) {
+      return 0;
+    }
+    memset(argument->data, 0, sizeof(argument->data));
+    for(int i = 0; i < width; ++i, value = scm_cdr(value)) {
+      pack_scalar(type, scm_car(value), argument->data + i * type->size);
+    }
+    // 3-component vectors are aligned like 4-component ones
+    argument->size = type->size * (width == 3 ? 4 : width);
+  }
+  argument->value = argument->data;
+  return 1;
+}
+
+// Memory objects are passed as they are, (type . value) pairs are packed
+// as the given OpenCL C type, (local . size) reserves size bytes of local
+// memory, and plain numbers are passed as int or float.
+static int
+kernel_argument(SCM value, struct kernel_argument *argument) {
+  if(SCM_SMOB_PREDICATE(cl_buffer_tag, value)
+     || SCM_SMOB_PREDICATE(cl_sampler_tag, value)
+     || SCM_SMOB_PREDICATE(cl_image2d_tag, value)
+     || SCM_SMOB_PREDICATE(cl_image3d_tag, value)) {
+    cl_mem buffer = (cl_mem) SCM_SMOB_DATA(value);
+    memcpy(argument->data, &buffer, sizeof(cl_mem));
+    argument->size = sizeof(cl_mem);
+    argument->value = argument->data;
+    argument->memory = buffer;
+    return 1;
+  }
+  argument->memory = NULL;
+  if(scm_is_pair(value) && scm_is_symbol(scm_car(value))) {
+    char *type = scm_to_locale_string(scm_symbol_to_string(scm_car(value)));
+    int success;
+    if(!strcasecmp("local", type)) {
+      argument->size = scm_to_size_t(scm_cdr(value));
+      argument->value = NULL;
+      success = 1;
+    }
+    else {
+      success = pack_typed_value(type, scm_cdr(value), argument);
+    }
+    free(type);
+    return success;
+  }
+  if(scm_is_integer(value) && scm_is_true(scm_exact_p(value))) {
+    return pack_typed_value("int", value, argument);
+  }
+  if(scm_is_real(value)) {
+    return pack_typed_value("float", value, argument);
+  }
+  return 0;
+}
+
+static void
+capture_bind(cl_kernel kernel, int num_arguments,
+	     const struct kernel_argument *arguments, uint64_t start_ns) {
+  struct trace_buffer payload = { NULL, 0, 0 };
+  trace_put_u64(&payload, TRACE_ID(kernel));
+  trace_put_u32(&payload, num_arguments);
+  for(int i = 0; i < num_arguments; ++i) {
+    const struct kernel_argument *argument = &arguments[i];
+    if(argument->value == NULL) {
+      trace_put_u8(&payload, TRACE_ARGUMENT_LOCAL);
+      trace_put_u64(&payload, argument->size);
+    }
+    else if(argument->memory) {
+      trace_put_u8(&payload, TRACE_ARGUMENT_MEMORY);
+      trace_put_u64(&payload, argument->size);
+      trace_put_u64(&payload, TRACE_ID(argument->memory));
+    }
+    else {
+      trace_put_u8(&payload, TRACE_ARGUMENT_VALUE);
+      trace_put_u64(&payload, argument->size);
+      trace_put_blob(&payload, argument->value, argument->size);
+    }
+  }
+  capture(TRACE_BIND, start_ns, &payload);
+}
+
+// clSetKernelArg doesn't retain the buffers, which are released when
+// their smobs are collected, so the arguments bound to each kernel smob
+// are kept in a table that is weak in its keys
+static SCM kernel_arguments = SCM_BOOL_F;
+
 static SCM
 bind_arguments(SCM kernel, SCM arguments) {
   scm_assert_smob_type(cl_kernel_tag, kernel);
   cl_kernel kernel_id = (cl_kernel) SCM_SMOB_DATA(kernel);
   char *kernel_name = (char *) SCM_SMOB_DATA_2(kernel);
+  int num_arguments = scm_to_int(scm_length(arguments));
+  scm_hashq_set_x(kernel_arguments, kernel, arguments);
+  struct kernel_argument *packed
+    = alloca(num_arguments * sizeof(struct kernel_argument));
+  uint64_t start = now_ns();
   
   for(int i = 0; scm_is_pair(arguments); ++i, arguments = scm_cdr(arguments)) {
-    SCM argument = scm_car(arguments);
+    struct kernel_argument *argument = &packed[i];
     cl_int result;
-    cl_mem buffer = (cl_mem) SCM_SMOB_DATA(argument);
-    if(SCM_SMOB_PREDICATE(cl_buffer_tag, argument)
-       || SCM_SMOB_PREDICATE(cl_sampler_tag, argument)
-       || SCM_SMOB_PREDICATE(cl_image2d_tag, argument)
-       || SCM_SMOB_PREDICATE(cl_image3d_tag, argument)) {
-      result = clSetKernelArg(kernel_id, i, sizeof(cl_mem), &buffer);
+    if(kernel_argument(scm_car(arguments), argument)) {
+      result = clSetKernelArg(kernel_id, i, argument->size, argument->value);
     }
     else {
       WARN("Unrecognized argument type for argument %d to kernel %s",
 	   i, kernel_name);
+      argument->size = 0;
+      argument->value = NULL;
       result = clSetKernelArg(kernel_id, i, 0, NULL);
     }
     if(result != CL_SUCCESS) {
@@ -647,59 +1646,506 @@ bind_arguments(SCM kernel, SCM arguments) {
       cl_warn(result);
     }
   }
+  if(CAPTURING) {
+    capture_bind(kernel_id, num_arguments, packed, start);
+  }
   return SCM_UNSPECIFIED;
 }
 
-static SCM
-enqueue_write_buffer_x(SCM s_queue, SCM s_buffer, SCM s_offset, SCM s_size) {
-  assert(sizeof(cl_event) == sizeof(scm_t_bits));
-  scm_assert_smob_type(cl_command_queue_tag, s_queue);
-  scm_assert_smob_type(cl_buffer_tag, s_buffer);
-  cl_command_queue queue = (cl_command_queue) SCM_SMOB_DATA(s_queue);
-  cl_mem buffer = (cl_mem) SCM_SMOB_DATA(s_buffer);
-  int offset = SCM_UNBNDP(s_offset) ? 0 : scm_to_int(s_offset);
-  int size = SCM_UNBNDP(s_size)
-    ? ((int) SCM_SMOB_DATA_2(s_buffer))
-    : scm_to_int(s_size);
-  cl_event event;
-  cl_int result = clEnqueueWriteBuffer(queue, buffer, CL_FALSE, offset, size,
-				       (void *) SCM_SMOB_DATA_3(s_buffer),
-				       0, (const cl_event *) NULL,
-				       &event);
-  if(result != CL_SUCCESS) {
-    WARN("Failed to enqueue write buffer %x on queue %x: 0x%x",
-	 buffer, queue, result);
-    return SCM_BOOL_F;
-  }
+// A staging pool is a ring of pinned (CL_MEM_ALLOC_HOST_PTR) buffers
+// that stay mapped for their whole lifetime. Transfers routed through
+// the pool are split into chunks, so that copying one chunk on the host
+// overlaps with the DMA of the previous one, and the runtime doesn't need
+// to make its own copy of pageable memory.
 
-  return scm_new_smob(cl_event_tag, (scm_t_bits) event);
-}
+struct staging_slot {
+  cl_mem buffer;
+  void *host;
+  cl_event event; // the last transfer that used the slot, or NULL
+};
 
-static SCM
-enqueue_read_buffer_x(SCM s_queue, SCM s_buffer, SCM s_offset, SCM s_size) {
-  assert(sizeof(cl_event) == sizeof(scm_t_bits));
+// The statistics are shared with the completion callbacks of staged
+// writes, which may run after the pool is released, so they are freed
+// when the last of these references is dropped.
+struct staging_stats {
+  uint64_t bytes_written;
+  uint64_t bytes_read;
+  uint64_t write_ns;
+  uint64_t read_ns;
+  uint64_t writes;
+  uint64_t reads;
+  int references;
+};
+
+struct staging_pool {
+  cl_command_queue queue; // used for mapping and unmapping the slots
+  size_t chunk_size;
+  int num_slots;
+  int next_slot;
+  struct staging_stats *stats;
+  struct staging_slot slots[];
+};
+
+static struct staging_pool *current_staging_pool = NULL;
+
+static void
+release_staging_stats(struct staging_stats *stats) {
+  if(__atomic_sub_fetch(&stats->references, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(stats);
+  }
+}
+
+static void
+release_staging_pool(struct staging_pool *pool) {
+  for(int i = 0; i < pool->num_slots; ++i) {
+    struct staging_slot *slot = &pool->slots[i];
+    if(slot->event) {
+      clWaitForEvents(1, &slot->event);
+      clReleaseEvent(slot->event);
+    }
+    if(slot->host) {
+      clEnqueueUnmapMemObject(pool->queue, slot->buffer, slot->host,
+			      0, NULL, NULL);
+    }
+    if(slot->buffer) {
+      clReleaseMemObject(slot->buffer);
+    }
+  }
+  clFinish(pool->queue);
+  clReleaseCommandQueue(pool->queue);
+  release_staging_stats(pool->stats);
+  free(pool);
+}
+
+static SCM
+create_staging_pool(SCM s_queue, SCM s_chunk_size, SCM s_num_slots) {
+  scm_assert_smob_type(cl_command_queue_tag, s_queue);
+  cl_command_queue queue = (cl_command_queue) SCM_SMOB_DATA(s_queue);
+  size_t chunk_size = SCM_UNBNDP(s_chunk_size)
+    ? (4 << 20)
+    : scm_to_size_t(s_chunk_size);
+  int num_slots = SCM_UNBNDP(s_num_slots) ? 4 : scm_to_int(s_num_slots);
+  if(chunk_size == 0 || num_slots < 1) {
+    WARN("Invalid staging pool geometry: %d slots of %zu bytes",
+	 num_slots, chunk_size);
+    return SCM_BOOL_F;
+  }
+  cl_context context = (cl_context) SCM_SMOB_DATA(current_context());
+  struct staging_pool *pool
+    = calloc(1, sizeof(struct staging_pool)
+	     + num_slots * sizeof(struct staging_slot));
+  pool->queue = queue;
+  pool->chunk_size = chunk_size;
+  pool->num_slots = num_slots;
+  pool->stats = calloc(1, sizeof(struct staging_stats));
+  pool->stats->references = 1;
+  clRetainCommandQueue(queue);
+
+  for(int i = 0; i < num_slots; ++i) {
+    struct staging_slot *slot = &pool->slots[i];
+    cl_int result;
+    slot->buffer = clCreateBuffer(context,
+				  CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+				  chunk_size, NULL, &result);
+    if(result != CL_SUCCESS) {
+      WARN_("Failed to allocate staging buffer of size %zu: ", chunk_size);
+      cl_warn(result);
+      slot->buffer = NULL;
+      release_staging_pool(pool);
+      return SCM_BOOL_F;
+    }
+    slot->host = clEnqueueMapBuffer(queue, slot->buffer, CL_TRUE,
+				    CL_MAP_READ | CL_MAP_WRITE,
+				    0, chunk_size, 0, NULL, NULL, &result);
+    if(result != CL_SUCCESS) {
+      WARN_("Failed to map staging buffer %d: ", i);
+      cl_warn(result);
+      slot->host = NULL;
+      release_staging_pool(pool);
+      return SCM_BOOL_F;
+    }
+  }
+  return scm_new_smob(cl_staging_pool_tag, (scm_t_bits) pool);
+}
+
+static size_t
+staging_pool_smob_free(SCM s_pool) {
+  struct staging_pool *pool = (struct staging_pool *) SCM_SMOB_DATA(s_pool);
+  if(pool == current_staging_pool) {
+    current_staging_pool = NULL;
+  }
+  release_staging_pool(pool);
+  return 0;
+}
+
+static SCM
+call_with_staging_pool(SCM s_pool, SCM thunk) {
+  struct staging_pool *previous_staging_pool = current_staging_pool;
+  if(scm_is_false(s_pool)) {
+    current_staging_pool = NULL;
+  }
+  else {
+    scm_assert_smob_type(cl_staging_pool_tag, s_pool);
+    current_staging_pool = (struct staging_pool *) SCM_SMOB_DATA(s_pool);
+  }
+  SCM result = scm_call_0(thunk);
+  current_staging_pool = previous_staging_pool;
+  return result;
+}
+
+static cl_int
+wait_for_staging_slot(struct staging_slot *slot) {
+  cl_int result = CL_SUCCESS;
+  if(slot->event) {
+    result = clWaitForEvents(1, &slot->event);
+    clReleaseEvent(slot->event);
+    slot->event = NULL;
+  }
+  return result;
+}
+
+struct staging_write {
+  struct staging_stats *stats;
+  uint64_t start_ns;
+};
+
+static void CL_CALLBACK
+on_staged_write_complete(cl_event event, cl_int status, void *data) {
+  struct staging_write *write = (struct staging_write *) data;
+  __atomic_fetch_add(&write->stats->write_ns,
+		     now_ns() - write->start_ns, __ATOMIC_RELAXED);
+  release_staging_stats(write->stats);
+  free(write);
+}
+
+static cl_int
+staged_write(struct staging_pool *pool, cl_command_queue queue,
+	     cl_mem buffer, size_t offset, size_t size,
+	     const char *source, cl_event *event) {
+  uint64_t start = now_ns();
+  cl_event *pending = alloca(pool->num_slots * sizeof(cl_event));
+  int num_pending = 0;
+  cl_int result = CL_SUCCESS;
+
+  for(size_t position = 0; position < size; ) {
+    struct staging_slot *slot = &pool->slots[pool->next_slot];
+    size_t chunk = size - position < pool->chunk_size
+      ? size - position
+      : pool->chunk_size;
+    pool->next_slot = (pool->next_slot + 1) % pool->num_slots;
+    if((result = wait_for_staging_slot(slot)) != CL_SUCCESS) {
+      return result;
+    }
+    memcpy(slot->host, source + position, chunk);
+    result = clEnqueueWriteBuffer(queue, buffer, CL_FALSE,
+				  offset + position, chunk, slot->host,
+				  0, NULL, &slot->event);
+    if(result != CL_SUCCESS) {
+      slot->event = NULL;
+      return result;
+    }
+    // start the DMA of this chunk while we fill the next one
+    clFlush(queue);
+    if(num_pending < pool->num_slots) {
+      ++num_pending;
+    }
+    position += chunk;
+  }
+
+  // the chunks that haven't been waited for are those
+  // in the last num_pending slots before next_slot
+  for(int i = 0; i < num_pending; ++i) {
+    int s = (pool->next_slot + pool->num_slots - num_pending + i)
+      % pool->num_slots;
+    pending[i] = pool->slots[s].event;
+  }
+  result = clEnqueueMarkerWithWaitList(queue, num_pending, pending, event);
+  if(result == CL_SUCCESS) {
+    struct staging_write *write = malloc(sizeof(struct staging_write));
+    write->stats = pool->stats;
+    write->start_ns = start;
+    __atomic_add_fetch(&pool->stats->references, 1, __ATOMIC_RELAXED);
+    if(clSetEventCallback(*event, CL_COMPLETE, on_staged_write_complete,
+			  write) != CL_SUCCESS) {
+      release_staging_stats(write->stats);
+      free(write);
+    }
+    __atomic_fetch_add(&pool->stats->bytes_written, size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pool->stats->writes, 1, __ATOMIC_RELAXED);
+  }
+  return result;
+}
+
+static cl_int
+staged_read(struct staging_pool *pool, cl_command_queue queue,
+	    cl_mem buffer, size_t offset, size_t size,
+	    char *target, cl_event *event) {
+  uint64_t start = now_ns();
+  size_t chunk_size = pool->chunk_size;
+  size_t num_chunks = (size + chunk_size - 1) / chunk_size;
+  int first_slot = pool->next_slot;
+  cl_int result = CL_SUCCESS;
+
+#define SLOT(k) (&pool->slots[(first_slot + (k)) % pool->num_slots])
+#define CHUNK(k) ((k) + 1 < num_chunks ? chunk_size : size - (k) * chunk_size)
+
+  *event = NULL;
+  for(size_t k = 0; k < num_chunks && k < pool->num_slots; ++k) {
+    struct staging_slot *slot = SLOT(k);
+    if((result = wait_for_staging_slot(slot)) != CL_SUCCESS) {
+      return result;
+    }
+    result = clEnqueueReadBuffer(queue, buffer, CL_FALSE,
+				 offset + k * chunk_size, CHUNK(k), slot->host,
+				 0, NULL, &slot->event);
+    if(result != CL_SUCCESS) {
+      slot->event = NULL;
+      return result;
+    }
+  }
+  clFlush(queue);
+
+  for(size_t k = 0; k < num_chunks; ++k) {
+    struct staging_slot *slot = SLOT(k);
+    if((result = clWaitForEvents(1, &slot->event)) != CL_SUCCESS) {
+      return result;
+    }
+    memcpy(target + k * chunk_size, slot->host, CHUNK(k));
+    if(k + 1 == num_chunks) {
+      // the caller takes over the last event
+      *event = slot->event;
+      slot->event = NULL;
+      break;
+    }
+    clReleaseEvent(slot->event);
+    slot->event = NULL;
+    if(k + pool->num_slots < num_chunks) {
+      size_t n = k + pool->num_slots;
+      result = clEnqueueReadBuffer(queue, buffer, CL_FALSE,
+				   offset + n * chunk_size, CHUNK(n),
+				   slot->host, 0, NULL, &slot->event);
+      if(result != CL_SUCCESS) {
+	slot->event = NULL;
+	return result;
+      }
+      clFlush(queue);
+    }
+  }
+  pool->next_slot = (first_slot + num_chunks) % pool->num_slots;
+
+#undef CHUNK
+#undef SLOT
+
+  if(*event == NULL) {
+    // nothing to read
+    result = clEnqueueMarkerWithWaitList(queue, 0, NULL, event);
+  }
+  __atomic_fetch_add(&pool->stats->read_ns, now_ns() - start, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&pool->stats->bytes_read, size, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&pool->stats->reads, 1, __ATOMIC_RELAXED);
+  return result;
+}
+
+static SCM
+bandwidth(uint64_t bytes, uint64_t ns) {
+  return scm_from_double(ns ? (1e9 * bytes) / ns : 0.0);
+}
+
+static SCM
+staging_pool_stats(SCM s_pool) {
+  scm_assert_smob_type(cl_staging_pool_tag, s_pool);
+  struct staging_pool *pool = (struct staging_pool *) SCM_SMOB_DATA(s_pool);
+  uint64_t bytes_written
+    = __atomic_load_n(&pool->stats->bytes_written, __ATOMIC_RELAXED);
+  uint64_t bytes_read
+    = __atomic_load_n(&pool->stats->bytes_read, __ATOMIC_RELAXED);
+  uint64_t write_ns = __atomic_load_n(&pool->stats->write_ns, __ATOMIC_RELAXED);
+  uint64_t read_ns = __atomic_load_n(&pool->stats->read_ns, __ATOMIC_RELAXED);
+  SCM stats = SCM_EOL;
+  stats = scm_acons(scm_from_latin1_symbol("read-bandwidth"),
+		    bandwidth(bytes_read, read_ns), stats);
+  stats = scm_acons(scm_from_latin1_symbol("write-bandwidth"),
+		    bandwidth(bytes_written, write_ns), stats);
+  stats = scm_acons(scm_from_latin1_symbol("read-seconds"),
+		    scm_from_double(read_ns * 1e-9), stats);
+  stats = scm_acons(scm_from_latin1_symbol("write-seconds"),
+		    scm_from_double(write_ns * 1e-9), stats);
+  stats = scm_acons(scm_from_latin1_symbol("bytes-read"),
+		    scm_from_uint64(bytes_read), stats);
+  stats = scm_acons(scm_from_latin1_symbol("bytes-written"),
+		    scm_from_uint64(bytes_written), stats);
+  stats = scm_acons(scm_from_latin1_symbol("reads"),
+		    scm_from_uint64(__atomic_load_n(&pool->stats->reads,
+						    __ATOMIC_RELAXED)),
+		    stats);
+  stats = scm_acons(scm_from_latin1_symbol("writes"),
+		    scm_from_uint64(__atomic_load_n(&pool->stats->writes,
+						    __ATOMIC_RELAXED)),
+		    stats);
+  return stats;
+}
+
+static SCM
+enqueue_write_buffer_x(SCM s_queue, SCM s_buffer, SCM s_offset, SCM s_size) {
+  assert(sizeof(cl_event) == sizeof(scm_t_bits));
   scm_assert_smob_type(cl_command_queue_tag, s_queue);
   scm_assert_smob_type(cl_buffer_tag, s_buffer);
   cl_command_queue queue = (cl_command_queue) SCM_SMOB_DATA(s_queue);
   cl_mem buffer = (cl_mem) SCM_SMOB_DATA(s_buffer);
-  int offset = SCM_UNBNDP(s_offset) ? 0 : scm_to_int(s_offset);
-  int size = SCM_UNBNDP(s_size)
-    ? ((int) SCM_SMOB_DATA_2(s_buffer))
-    : scm_to_int(s_size);
+  size_t buffer_size = (size_t) SCM_SMOB_DATA_2(s_buffer);
+  size_t offset = SCM_UNBNDP(s_offset) ? 0 : scm_to_size_t(s_offset);
+  if(offset > buffer_size) {
+    WARN("Offset %zu is past the end of buffer %p (%zu bytes)",
+	 offset, buffer, buffer_size);
+    return SCM_BOOL_F;
+  }
+  size_t size = SCM_UNBNDP(s_size)
+    ? buffer_size - offset
+    : scm_to_size_t(s_size);
+  if(size > buffer_size - offset) {
+    WARN("Transfer of %zu bytes at offset %zu overruns buffer %p (%zu bytes)",
+	 size, offset, buffer, buffer_size);
+    return SCM_BOOL_F;
+  }
+  void *host_ptr = (void *) SCM_SMOB_DATA_3(s_buffer);
+  struct staging_pool *pool = host_ptr ? current_staging_pool : NULL;
+  uint64_t start = now_ns();
   cl_event event;
-  cl_int result = clEnqueueReadBuffer(queue, buffer, CL_FALSE, offset, size,
-				      (void *) SCM_SMOB_DATA_3(s_buffer),
-				      0, (const cl_event *) NULL,
-				      &event);
+  cl_int result;
+  if(pool) {
+    result = staged_write(pool, queue, buffer, offset, size,
+			  host_ptr, &event);
+  }
+  else {
+    result = clEnqueueWriteBuffer(queue, buffer, CL_FALSE, offset, size,
+				  host_ptr, 0, (const cl_event *) NULL,
+				  &event);
+  }
+  count_enqueue(ENQUEUE_WRITE, start);
   if(result != CL_SUCCESS) {
-    WARN("Failed to enqueue read buffer %x on queue %x: 0x%x",
+    WARN("Failed to enqueue write buffer %p on queue %p: 0x%x",
 	 buffer, queue, result);
     return SCM_BOOL_F;
   }
+  __atomic_fetch_add(&QUEUE_COUNTERS(s_queue)->bytes_written, size,
+		     __ATOMIC_RELAXED);
+  if(CAPTURING) {
+    struct trace_buffer payload = { NULL, 0, 0 };
+    trace_put_u64(&payload, TRACE_ID(queue));
+    trace_put_u64(&payload, TRACE_ID(buffer));
+    trace_put_u64(&payload, offset);
+    trace_put_u64(&payload, size);
+    trace_put_u64(&payload, pool ? pool->chunk_size : 0);
+    trace_put_u32(&payload, pool ? pool->num_slots : 0);
+    trace_put_blob(&payload, host_ptr,
+		   host_ptr && capture_contents() ? size : 0);
+    capture(TRACE_WRITE, start, &payload);
+  }
+
+  return scm_new_smob(cl_event_tag, (scm_t_bits) event);
+}
+
+static SCM
+enqueue_read_buffer_x(SCM s_queue, SCM s_buffer, SCM s_offset, SCM s_size) {
+  assert(sizeof(cl_event) == sizeof(scm_t_bits));
+  scm_assert_smob_type(cl_command_queue_tag, s_queue);
+  scm_assert_smob_type(cl_buffer_tag, s_buffer);
+  cl_command_queue queue = (cl_command_queue) SCM_SMOB_DATA(s_queue);
+  cl_mem buffer = (cl_mem) SCM_SMOB_DATA(s_buffer);
+  size_t buffer_size = (size_t) SCM_SMOB_DATA_2(s_buffer);
+  size_t offset = SCM_UNBNDP(s_offset) ? 0 : scm_to_size_t(s_offset);
+  if(offset > buffer_size) {
+    WARN("Offset %zu is past the end of buffer %p (%zu bytes)",
+	 offset, buffer, buffer_size);
+    return SCM_BOOL_F;
+  }
+  size_t size = SCM_UNBNDP(s_size)
+    ? buffer_size - offset
+    : scm_to_size_t(s_size);
+  if(size > buffer_size - offset) {
+    WARN("Transfer of %zu bytes at offset %zu overruns buffer %p (%zu bytes)",
+	 size, offset, buffer, buffer_size);
+    return SCM_BOOL_F;
+  }
+  void *host_ptr = (void *) SCM_SMOB_DATA_3(s_buffer);
+  struct staging_pool *pool = host_ptr ? current_staging_pool : NULL;
+  uint64_t start = now_ns();
+  cl_event event;
+  cl_int result;
+  if(pool) {
+    result = staged_read(pool, queue, buffer, offset, size,
+			 host_ptr, &event);
+  }
+  else {
+    result = clEnqueueReadBuffer(queue, buffer, CL_FALSE, offset, size,
+				 host_ptr, 0, (const cl_event *) NULL,
+				 &event);
+  }
+  count_enqueue(ENQUEUE_READ, start);
+  if(result != CL_SUCCESS) {
+    WARN("Failed to enqueue read buffer %p on queue %p: 0x%x",
+	 buffer, queue, result);
+    return SCM_BOOL_F;
+  }
+  __atomic_fetch_add(&QUEUE_COUNTERS(s_queue)->bytes_read, size,
+		     __ATOMIC_RELAXED);
+  if(CAPTURING) {
+    struct trace_buffer payload = { NULL, 0, 0 };
+    trace_put_u64(&payload, TRACE_ID(queue));
+    trace_put_u64(&payload, TRACE_ID(buffer));
+    trace_put_u64(&payload, offset);
+    trace_put_u64(&payload, size);
+    trace_put_u64(&payload, pool ? pool->chunk_size : 0);
+    trace_put_u32(&payload, pool ? pool->num_slots : 0);
+    capture(TRACE_READ, start, &payload);
+  }
   return scm_new_smob(cl_event_tag, (scm_t_bits) event);
 }
 
 
+static SCM
+enqueue_copy_buffer_x(SCM s_queue, SCM s_source, SCM s_target,
+		      SCM s_source_offset, SCM s_target_offset, SCM s_size) {
+  assert(sizeof(cl_event) == sizeof(scm_t_bits));
+  scm_assert_smob_type(cl_command_queue_tag, s_queue);
+  scm_assert_smob_type(cl_buffer_tag, s_source);
+  scm_assert_smob_type(cl_buffer_tag, s_target);
+  cl_command_queue queue = (cl_command_queue) SCM_SMOB_DATA(s_queue);
+  cl_mem source = (cl_mem) SCM_SMOB_DATA(s_source);
+  cl_mem target = (cl_mem) SCM_SMOB_DATA(s_target);
+  size_t source_offset = SCM_UNBNDP(s_source_offset)
+    ? 0 : scm_to_size_t(s_source_offset);
+  size_t target_offset = SCM_UNBNDP(s_target_offset)
+    ? 0 : scm_to_size_t(s_target_offset);
+  size_t size = SCM_UNBNDP(s_size)
+    ? ((size_t) SCM_SMOB_DATA_2(s_source)) - source_offset
+    : scm_to_size_t(s_size);
+  uint64_t start = now_ns();
+  cl_event event;
+  cl_int result = clEnqueueCopyBuffer(queue, source, target,
+				      source_offset, target_offset, size,
+				      0, (const cl_event *) NULL, &event);
+  count_enqueue(ENQUEUE_COPY, start);
+  if(result != CL_SUCCESS) {
+    WARN("Failed to enqueue copy from buffer %p to %p on queue %p: 0x%x",
+	 (void *) source, (void *) target, (void *) queue, result);
+    return SCM_BOOL_F;
+  }
+  __atomic_fetch_add(&QUEUE_COUNTERS(s_queue)->bytes_copied, size,
+		     __ATOMIC_RELAXED);
+  if(CAPTURING) {
+    struct trace_buffer payload = { NULL, 0, 0 };
+    trace_put_u64(&payload, TRACE_ID(queue));
+    trace_put_u64(&payload, TRACE_ID(source));
+    trace_put_u64(&payload, TRACE_ID(target));
+    trace_put_u64(&payload, source_offset);
+    trace_put_u64(&payload, target_offset);
+    trace_put_u64(&payload, size);
+    capture(TRACE_COPY, start, &payload);
+  }
+  return scm_new_smob(cl_event_tag, (scm_t_bits) event);
+}
+
 static SCM
 enqueue_kernel_x(SCM s_queue, SCM s_kernel, SCM s_dims, SCM s_local_dims) {
   scm_assert_smob_type(cl_command_queue_tag, s_queue);
@@ -741,24 +2187,1019 @@ enqueue_kernel_x(SCM s_queue, SCM s_kernel, SCM s_dims, SCM s_local_dims) {
   cl_kernel kernel = (cl_kernel) SCM_SMOB_DATA(s_kernel);
   char *kernel_name = (char *) SCM_SMOB_DATA_2(s_kernel);
   
+  uint64_t start = now_ns();
   cl_event event;
   cl_int result = clEnqueueNDRangeKernel(queue, kernel, dims,
 					 NULL, global_work_size, local_work_size,
 					 0, (const cl_event *) NULL,
 					 &event);
+  count_enqueue(ENQUEUE_KERNEL, start);
   if(result != CL_SUCCESS) {
     WARN("Failed to enqueue kernel %s on queue %x: 0x%x",
 	 kernel_name, queue, result);
     return SCM_BOOL_F;
   }
+  __atomic_fetch_add(&KERNEL_COUNTERS(s_kernel)->launches, 1,
+		     __ATOMIC_RELAXED);
+  if(CAPTURING) {
+    capture_launch(queue, kernel, dims, global_work_size, local_work_size,
+		   start);
+  }
 
   return scm_new_smob(cl_event_tag, (scm_t_bits) event);
 }
 
+// Explicit migration of buffers between the devices of a context,
+// so that the inputs of a kernel can be moved ahead of its launch
+// rather than implicitly on the first use.
+
+static cl_mem_migration_flags
+parse_migration_flags(SCM symbols) {
+  cl_mem_migration_flags flags = (cl_mem_migration_flags) 0;
+  for(; scm_is_pair(symbols); symbols = scm_cdr(symbols)) {
+    char *symbol
+      = scm_to_locale_string(scm_symbol_to_string(scm_car(symbols)));
+    if(!strcasecmp("host", symbol)
+       || !strcasecmp("to-host", symbol)) {
+      flags |= CL_MIGRATE_MEM_OBJECT_HOST;
+    }
+    else if(!strcasecmp("content-undefined", symbol)
+	    || !strcasecmp("content_undefined", symbol)) {
+      flags |= CL_MIGRATE_MEM_OBJECT_CONTENT_UNDEFINED;
+    }
+    else {
+      WARN("Unsupported migration option: %s", symbol);
+    }
+    free(symbol);
+  }
+  return flags;
+}
+
+// the (queue . migration-flags) hint for each buffer; the table is
+// weak in its keys, the buffer smobs, so the hints go with the buffers
+static SCM buffer_placement = SCM_BOOL_F;
+
+static cl_int
+migrate_buffers(cl_command_queue queue, int num_buffers, SCM *buffers,
+		cl_mem_migration_flags flags, cl_event *event) {
+  cl_mem *mems = alloca(num_buffers * sizeof(cl_mem));
+  for(int i = 0; i < num_buffers; ++i) {
+    mems[i] = (cl_mem) SCM_SMOB_DATA(buffers[i]);
+  }
+  uint64_t start = now_ns();
+  cl_int result = clEnqueueMigrateMemObjects(queue, num_buffers, mems, flags,
+					     0, NULL, event);
+  count_enqueue(ENQUEUE_MIGRATE, start);
+  if(result != CL_SUCCESS) {
+    return result;
+  }
+
+  // kernels may move buffers implicitly, so there is no telling whether
+  // a buffer is already where it is migrated to, and every buffer counts
+  for(int i = 0; i < num_buffers; ++i) {
+    COUNT(buffers_migrated, 1);
+    if(!(flags & CL_MIGRATE_MEM_OBJECT_CONTENT_UNDEFINED)) {
+      size_t size = (size_t) SCM_SMOB_DATA_2(buffers[i]);
+      COUNT(bytes_migrated, size);
+      if(flags & CL_MIGRATE_MEM_OBJECT_HOST) {
+	COUNT(bytes_to_host, size);
+      }
+    }
+  }
+  COUNT(migrations, 1);
+  if(CAPTURING) {
+    struct trace_buffer payload = { NULL, 0, 0 };
+    trace_put_u64(&payload, TRACE_ID(queue));
+    trace_put_u64(&payload, flags);
+    trace_put_u32(&payload, num_buffers);
+    for(int i = 0; i < num_buffers; ++i) {
+      trace_put_u64(&payload, TRACE_ID(mems[i]));
+    }
+    capture(TRACE_MIGRATE, start, &payload);
+  }
+  return result;
+}
+
+static SCM
+enqueue_migrate_buffers_x(SCM s_queue, SCM s_buffers, SCM options) {
+  assert(sizeof(cl_event) == sizeof(scm_t_bits));
+  scm_assert_smob_type(cl_command_queue_tag, s_queue);
+  cl_command_queue queue = (cl_command_queue) SCM_SMOB_DATA(s_queue);
+  if(SCM_SMOB_PREDICATE(cl_buffer_tag, s_buffers)) {
+    s_buffers = scm_list_1(s_buffers);
+  }
+  int num_buffers = scm_to_int(scm_length(s_buffers));
+  if(num_buffers == 0) {
+    WARN("No buffers to migrate");
+    return SCM_BOOL_F;
+  }
+  SCM *buffers = alloca(num_buffers * sizeof(SCM));
+  for(int i = 0; scm_is_pair(s_buffers); ++i, s_buffers = scm_cdr(s_buffers)) {
+    buffers[i] = scm_car(s_buffers);
+    scm_assert_smob_type(cl_buffer_tag, buffers[i]);
+  }
+  cl_event event;
+  cl_int result = migrate_buffers(queue, num_buffers, buffers,
+				  parse_migration_flags(options), &event);
+  if(result != CL_SUCCESS) {
+    WARN_("Failed to enqueue migration of %d buffers on queue %p: ",
+	  num_buffers, (void *) queue);
+    cl_warn(result);
+    return SCM_BOOL_F;
+  }
+  return scm_new_smob(cl_event_tag, (scm_t_bits) event);
+}
+
+static SCM
+set_buffer_placement_x(SCM s_buffer, SCM s_queue, SCM options) {
+  scm_assert_smob_type(cl_buffer_tag, s_buffer);
+  if(scm_is_false(s_queue)) {
+    scm_hashq_remove_x(buffer_placement, s_buffer);
+  }
+  else {
+    scm_assert_smob_type(cl_command_queue_tag, s_queue);
+    cl_mem_migration_flags flags = parse_migration_flags(options);
+    if(flags & CL_MIGRATE_MEM_OBJECT_HOST) {
+      WARN("The placement hint refers to the device of the queue;"
+	   " use cl-enqueue-migrate-buffers! to move buffers to the host");
+      flags &= ~CL_MIGRATE_MEM_OBJECT_HOST;
+    }
+    scm_hashq_set_x(buffer_placement, s_buffer,
+		    scm_cons(s_queue, scm_from_uint64(flags)));
+  }
+  return SCM_UNSPECIFIED;
+}
+
+static SCM
+buffer_placement_hint(SCM s_buffer) {
+  scm_assert_smob_type(cl_buffer_tag, s_buffer);
+  SCM hint = scm_hashq_ref(buffer_placement, s_buffer, SCM_BOOL_F);
+  return scm_is_false(hint) ? hint : scm_car(hint);
+}
+
+static SCM
+prefetch_buffers_x(SCM s_buffers) {
+  if(SCM_SMOB_PREDICATE(cl_buffer_tag, s_buffers)) {
+    s_buffers = scm_list_1(s_buffers);
+  }
+  SCM events = SCM_EOL;
+  for(; scm_is_pair(s_buffers); s_buffers = scm_cdr(s_buffers)) {
+    SCM buffer = scm_car(s_buffers);
+    scm_assert_smob_type(cl_buffer_tag, buffer);
+    SCM hint = scm_hashq_ref(buffer_placement, buffer, SCM_BOOL_F);
+    if(scm_is_false(hint)) {
+      continue;
+    }
+    cl_command_queue queue = (cl_command_queue) SCM_SMOB_DATA(scm_car(hint));
+    cl_event event;
+    // the migration is always enqueued, because a kernel may have
+    // moved the buffer implicitly since it was last migrated
+    cl_int result = migrate_buffers(queue, 1, &buffer,
+				    scm_to_uint64(scm_cdr(hint)), &event);
+    if(result != CL_SUCCESS) {
+      WARN_("Failed to prefetch buffer %p to queue %p: ",
+	    (void *) SCM_SMOB_DATA(buffer), (void *) queue);
+      cl_warn(result);
+      continue;
+    }
+    events = scm_cons(scm_new_smob(cl_event_tag, (scm_t_bits) event), events);
+  }
+  return scm_reverse_x(events, SCM_EOL);
+}
+
+static size_t
+buffer_smob_free(SCM buffer) {
+  cl_mem mem = (cl_mem) SCM_SMOB_DATA(buffer);
+  clReleaseMemObject(mem);
+  COUNT(buffers_released, 1);
+  COUNT(bytes_released, (size_t) SCM_SMOB_DATA_2(buffer));
+  return 0;
+}
+
+static SCM
+get_migration_stats() {
+  struct counters total;
+  sum_counters(&total);
+  SCM stats = SCM_EOL;
+  stats = scm_acons(scm_from_latin1_symbol("bytes-to-host"),
+		    scm_from_uint64(total.bytes_to_host), stats);
+  stats = scm_acons(scm_from_latin1_symbol("bytes-migrated"),
+		    scm_from_uint64(total.bytes_migrated), stats);
+  stats = scm_acons(scm_from_latin1_symbol("buffers-migrated"),
+		    scm_from_uint64(total.buffers_migrated), stats);
+  stats = scm_acons(scm_from_latin1_symbol("migrations"),
+		    scm_from_uint64(total.migrations), stats);
+  return stats;
+}
+
+static SCM
+get_counters() {
+  struct counters total;
+  sum_counters(&total);
+
+  SCM latencies = SCM_EOL;
+  for(int call = NUM_ENQUEUE_CALLS - 1; call >= 0; --call) {
+    SCM buckets = SCM_EOL;
+    uint64_t count = 0;
+    for(int i = LATENCY_BUCKETS; i >= 0; --i) {
+      SCM bound = i == LATENCY_BUCKETS
+	? scm_from_latin1_symbol("+inf")
+	: scm_from_double((1 << i) * 1e-6);
+      buckets = scm_acons(bound,
+			  scm_from_uint64(total.enqueue_latency[call][i]),
+			  buckets);
+      count += total.enqueue_latency[call][i];
+    }
+    SCM latency = scm_list_3(scm_cons(scm_from_latin1_symbol("count"),
+				      scm_from_uint64(count)),
+			     scm_cons(scm_from_latin1_symbol("seconds"),
+				      scm_from_double(total.enqueue_ns[call]
+						      * 1e-9)),
+			     scm_cons(scm_from_latin1_symbol("buckets"),
+				      buckets));
+    latencies = scm_acons(scm_from_latin1_symbol(enqueue_call_names[call]),
+			  latency, latencies);
+  }
+
+  SCM queues = SCM_EOL;
+  for(struct queue_counters *q
+	= __atomic_load_n(&queue_counters, __ATOMIC_ACQUIRE);
+      q != NULL;
+      q = q->next) {
+    SCM counts = SCM_EOL;
+    counts = scm_acons(scm_from_latin1_symbol("bytes-copied"),
+		       scm_from_uint64(__atomic_load_n(&q->bytes_copied,
+						       __ATOMIC_RELAXED)),
+		       counts);
+    counts = scm_acons(scm_from_latin1_symbol("bytes-written"),
+		       scm_from_uint64(__atomic_load_n(&q->bytes_written,
+						       __ATOMIC_RELAXED)),
+		       counts);
+    counts = scm_acons(scm_from_latin1_symbol("bytes-read"),
+		       scm_from_uint64(__atomic_load_n(&q->bytes_read,
+						       __ATOMIC_RELAXED)),
+		       counts);
+    queues = scm_acons(scm_from_int(q->id), counts, queues);
+  }
+
+  SCM launches = SCM_EOL;
+  for(struct kernel_counters *k
+	= __atomic_load_n(&kernel_counters, __ATOMIC_ACQUIRE);
+      k != NULL;
+      k = k->next) {
+    launches = scm_acons(scm_from_locale_string(k->name),
+			 scm_from_uint64(__atomic_load_n(&k->launches,
+							 __ATOMIC_RELAXED)),
+			 launches);
+  }
+
+  SCM result = SCM_EOL;
+  result = scm_acons(scm_from_latin1_symbol("enqueue-latency"),
+		     latencies, result);
+  result = scm_acons(scm_from_latin1_symbol("bytes-migrated"),
+		     scm_from_uint64(total.bytes_migrated), result);
+  result = scm_acons(scm_from_latin1_symbol("migrations"),
+		     scm_from_uint64(total.migrations), result);
+  result = scm_acons(scm_from_latin1_symbol("bytes-live"),
+		     scm_from_uint64(total.bytes_allocated
+				     - total.bytes_released), result);
+  result = scm_acons(scm_from_latin1_symbol("buffers-live"),
+		     scm_from_uint64(total.buffers_created
+				     - total.buffers_released), result);
+  result = scm_acons(scm_from_latin1_symbol("build-seconds"),
+		     scm_from_double(total.build_ns * 1e-9), result);
+  result = scm_acons(scm_from_latin1_symbol("builds"),
+		     scm_from_uint64(total.builds), result);
+  result = scm_acons(scm_from_latin1_symbol("queues"), queues, result);
+  result = scm_acons(scm_from_latin1_symbol("launches"), launches, result);
+  return result;
+}
+
+static void
+write_counters(FILE *out) {
+  struct counters total;
+  sum_counters(&total);
+
+  fprintf(out, "# HELP clops_kernel_launches_total"
+	  " Number of enqueued kernel launches.\n"
+	  "# TYPE clops_kernel_launches_total counter\n");
+  for(struct kernel_counters *k
+	= __atomic_load_n(&kernel_counters, __ATOMIC_ACQUIRE);
+      k != NULL;
+      k = k->next) {
+    fprintf(out, "clops_kernel_launches_total{kernel=\"%s\"} %llu\n",
+	    k->name, (unsigned long long)
+	    __atomic_load_n(&k->launches, __ATOMIC_RELAXED));
+  }
+
+  fprintf(out, "# HELP clops_queue_bytes_total"
+	  " Number of bytes transferred by the commands of a queue.\n"
+	  "# TYPE clops_queue_bytes_total counter\n");
+  for(struct queue_counters *q
+	= __atomic_load_n(&queue_counters, __ATOMIC_ACQUIRE);
+      q != NULL;
+      q = q->next) {
+    fprintf(out, "clops_queue_bytes_total{queue=\"%d\",operation=\"read\"}"
+	    " %llu\n", q->id, (unsigned long long)
+	    __atomic_load_n(&q->bytes_read, __ATOMIC_RELAXED));
+    fprintf(out, "clops_queue_bytes_total{queue=\"%d\",operation=\"write\"}"
+	    " %llu\n", q->id, (unsigned long long)
+	    __atomic_load_n(&q->bytes_written, __ATOMIC_RELAXED));
+    fprintf(out, "clops_queue_bytes_total{queue=\"%d\",operation=\"copy\"}"
+	    " %llu\n", q->id, (unsigned long long)
+	    __atomic_load_n(&q->bytes_copied, __ATOMIC_RELAXED));
+  }
+
+  fprintf(out, "# HELP clops_builds_total Number of program builds.\n"
+	  "# TYPE clops_builds_total counter\n"
+	  "clops_builds_total %llu\n",
+	  (unsigned long long) total.builds);
+  fprintf(out, "# HELP clops_build_seconds_total"
+	  " Time spent building programs.\n"
+	  "# TYPE clops_build_seconds_total counter\n"
+	  "clops_build_seconds_total %.9f\n",
+	  total.build_ns * 1e-9);
+  fprintf(out, "# HELP clops_buffers_live Number of allocated buffers.\n"
+	  "# TYPE clops_buffers_live gauge\n"
+	  "clops_buffers_live %llu\n",
+	  (unsigned long long) (total.buffers_created
+				- total.buffers_released));
+  fprintf(out, "# HELP clops_buffer_bytes_live Size of allocated buffers.\n"
+	  "# TYPE clops_buffer_bytes_live gauge\n"
+	  "clops_buffer_bytes_live %llu\n",
+	  (unsigned long long) (total.bytes_allocated
+				- total.bytes_released));
+  fprintf(out, "# HELP clops_migrated_bytes_total"
+	  " Number of bytes moved by explicit migrations.\n"
+	  "# TYPE clops_migrated_bytes_total counter\n"
+	  "clops_migrated_bytes_total %llu\n",
+	  (unsigned long long) total.bytes_migrated);
+
+  fprintf(out, "# HELP clops_enqueue_seconds"
+	  " Time spent in the calls that enqueue commands.\n"
+	  "# TYPE clops_enqueue_seconds histogram\n");
+  for(int call = 0; call < NUM_ENQUEUE_CALLS; ++call) {
+    uint64_t count = 0;
+    for(int i = 0; i <= LATENCY_BUCKETS; ++i) {
+      count += total.enqueue_latency[call][i];
+      if(i < LATENCY_BUCKETS) {
+	fprintf(out, "clops_enqueue_seconds_bucket{call=\"%s\",le=\"%g\"}"
+		" %llu\n", enqueue_call_names[call], (1 << i) * 1e-6,
+		(unsigned long long) count);
+      }
+      else {
+	fprintf(out, "clops_enqueue_seconds_bucket{call=\"%s\",le=\"+Inf\"}"
+		" %llu\n", enqueue_call_names[call],
+		(unsigned long long) count);
+      }
+    }
+    fprintf(out, "clops_enqueue_seconds_sum{call=\"%s\"} %.9f\n",
+	    enqueue_call_names[call], total.enqueue_ns[call] * 1e-9);
+    fprintf(out, "clops_enqueue_seconds_count{call=\"%s\"} %llu\n",
+	    enqueue_call_names[call], (unsigned long long) count);
+  }
+}
+
+static SCM
+dump_counters(SCM s_path) {
+  char *path = scm_to_locale_string(s_path);
+  // the counters are written to a temporary file first, so that
+  // a collector never sees a partially written one
+  size_t length = strlen(path);
+  char *temporary = alloca(length + 5);
+  snprintf(temporary, length + 5, "%s.tmp", path);
+  FILE *out = fopen(temporary, "w");
+  SCM result = SCM_BOOL_T;
+  if(out == NULL) {
+    WARN("Failed to open %s for writing", temporary);
+    result = SCM_BOOL_F;
+  }
+  else {
+    write_counters(out);
+    fclose(out);
+    if(rename(temporary, path)
+       // on Windows, rename doesn't replace existing files
+       && (remove(path) || rename(temporary, path))) {
+      WARN("Failed to rename %s to %s", temporary, path);
+      result = SCM_BOOL_F;
+    }
+  }
+  free(path);
+  return result;
+}
+
+// Several tenants can share the devices through a scheduler, which
+// holds their kernel launches in per-tenant queues and decides when
+// to enqueue them. A tenant with a higher priority always goes first,
+// and tenants of equal priority share the device in proportion to their
+// weights, according to the execution time of their kernels. That time
+// is exact on queues created with profiling, and otherwise estimated
+// from the completion times of the launches on each queue. Each tenant
+// may only have a limited number of launches enqueued at a time, so that
+// the command queues stay short and an urgent launch doesn't wait behind
+// a deep backlog of batch work. The scheduler does its work whenever
+// one of its functions, or cl-finish!, is called.
+
+// the completion time of the last launch on a command queue
+struct queue_clock {
+  struct queue_clock *next;
+  cl_command_queue queue;
+  uint64_t last_completed_ns;
+};
+
+struct scheduled_launch {
+  struct scheduled_launch *next;
+  struct tenant *tenant;
+  cl_command_queue queue;
+  struct queue_clock *clock;
+  cl_program program;
+  cl_kernel kernel; // private to the launch, so its arguments are its own
+  struct kernel_counters *counters;
+  cl_uint dims;
+  size_t global_work_size[3];
+  size_t local_work_size[3];
+  int has_local_work_size;
+  int num_arguments;
+  struct kernel_argument *arguments;
+  int num_buffers;
+  cl_mem *buffers; // retained until the launch completes
+  int deferred;
+  uint64_t submitted_ns;
+  uint64_t enqueued_ns;
+  cl_event event;
+  int has_callback;
+  // set by the completion callback
+  int completed;
+  cl_int status;
+  uint64_t completed_ns;
+  uint64_t estimated_ns; // the kernel time, if it can't be profiled
+};
+
+struct tenant {
+  struct tenant *next;
+  char *name;
+  int priority;
+  double weight;
+  int max_in_flight;
+  int max_pending;
+  struct scheduled_launch *pending;
+  struct scheduled_launch *last_pending;
+  int num_pending;
+  int num_in_flight;
+  double virtual_time; // kernel nanoseconds divided by the weight
+  uint64_t kernel_ns;
+  uint64_t submitted;
+  uint64_t admitted;
+  uint64_t rejected;
+  uint64_t deferred;
+  uint64_t completed;
+  uint64_t failed;
+  uint64_t estimated; // launches whose kernel time couldn't be profiled
+  uint64_t latency_ns;
+  uint64_t latency[LATENCY_BUCKETS + 1];
+  int collected; // set by the free hook; schedule() frees it once idle
+};
+
+static struct tenant *tenants = NULL;
+static struct scheduled_launch *launches_in_flight = NULL;
+static struct queue_clock *queue_clocks = NULL;
+static pthread_mutex_t scheduler_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+tenant_smob_print(SCM s_tenant, SCM port, scm_print_state *unused) {
+  struct tenant *tenant = (struct tenant *) SCM_SMOB_DATA(s_tenant);
+  scm_puts("#<OpenCL tenant ", port);
+  scm_puts(tenant->name, port);
+  scm_puts(">", port);
+  return 1;
+}
+
+// its launches may still be pending or in flight, and the free hook
+// mustn't wait for the scheduler_mutex, so it only marks the tenant
+static size_t
+tenant_smob_free(SCM s_tenant) {
+  struct tenant *tenant = (struct tenant *) SCM_SMOB_DATA(s_tenant);
+  __atomic_store_n(&tenant->collected, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static SCM
+create_tenant(SCM name, SCM s_priority, SCM s_weight,
+	      SCM s_max_in_flight, SCM s_max_pending) {
+  struct tenant *tenant = calloc(1, sizeof(struct tenant));
+  tenant->name = scm_to_locale_string(name);
+  tenant->priority = SCM_UNBNDP(s_priority) ? 0 : scm_to_int(s_priority);
+  tenant->weight = SCM_UNBNDP(s_weight) ? 1.0 : scm_to_double(s_weight);
+  tenant->max_in_flight = SCM_UNBNDP(s_max_in_flight)
+    ? 2 : scm_to_int(s_max_in_flight);
+  tenant->max_pending = SCM_UNBNDP(s_max_pending)
+    ? 1024 : scm_to_int(s_max_pending);
+  if(tenant->weight <= 0.0 || tenant->max_in_flight < 1
+     || tenant->max_pending < 1) {
+    WARN("Invalid tenant %s: the weight and the numbers of launches"
+	 " in flight and pending must be positive", tenant->name);
+    free(tenant->name);
+    free(tenant);
+    return SCM_BOOL_F;
+  }
+  pthread_mutex_lock(&scheduler_mutex);
+  tenant->next = tenants;
+  tenants = tenant;
+  pthread_mutex_unlock(&scheduler_mutex);
+  return scm_new_smob(cl_tenant_tag, (scm_t_bits) tenant);
+}
+
+static void
+free_launch(struct scheduled_launch *launch) {
+  for(int i = 0; i < launch->num_buffers; ++i) {
+    clReleaseMemObject(launch->buffers[i]);
+  }
+  if(launch->event) {
+    clReleaseEvent(launch->event);
+  }
+  clReleaseKernel(launch->kernel);
+  clReleaseCommandQueue(launch->queue);
+  free(launch->buffers);
+  free(launch->arguments);
+  free(launch);
+}
+
+// must be called with the scheduler_mutex held
+static struct queue_clock *
+find_queue_clock(cl_command_queue queue) {
+  for(struct queue_clock *clock = queue_clocks; clock; clock = clock->next) {
+    if(clock->queue == queue) {
+      return clock;
+    }
+  }
+  struct queue_clock *clock = calloc(1, sizeof(struct queue_clock));
+  clock->queue = queue;
+  clock->next = queue_clocks;
+  queue_clocks = clock;
+  return clock;
+}
+
+static void
+complete_launch(struct scheduled_launch *launch, cl_int status,
+		uint64_t now) {
+  // the kernel started at the earliest when the launch was enqueued,
+  // and when the launch before it on the same queue completed
+  uint64_t previous = __atomic_exchange_n(&launch->clock->last_completed_ns,
+					  now, __ATOMIC_ACQ_REL);
+  uint64_t start = previous > launch->enqueued_ns
+    ? previous
+    : launch->enqueued_ns;
+  launch->estimated_ns = now > start ? now - start : 0;
+  launch->completed_ns = now;
+  launch->status = status;
+  __atomic_store_n(&launch->completed, 1, __ATOMIC_RELEASE);
+}
+
+static void CL_CALLBACK
+on_launch_complete(cl_event event, cl_int status, void *data) {
+  complete_launch((struct scheduled_launch *) data, status, now_ns());
+}
+
+static int
+kernel_time_ns(struct scheduled_launch *launch, uint64_t *time) {
+  cl_ulong start, end;
+  if(launch->status == CL_COMPLETE
+     && clGetEventProfilingInfo(launch->event, CL_PROFILING_COMMAND_START,
+				sizeof(start), &start, NULL) == CL_SUCCESS
+     && clGetEventProfilingInfo(launch->event, CL_PROFILING_COMMAND_END,
+				sizeof(end), &end, NULL) == CL_SUCCESS
+     && end >= start) {
+    *time = end - start;
+    return 1;
+  }
+  *time = launch->estimated_ns;
+  return 0;
+}
+
+static void
+retire_launches() {
+  struct scheduled_launch **link = &launches_in_flight;
+  while(*link) {
+    struct scheduled_launch *launch = *link;
+    if(!launch->has_callback) {
+      cl_int status;
+      if(clGetEventInfo(launch->event, CL_EVENT_COMMAND_EXECUTION_STATUS,
+			sizeof(status), &status, NULL) != CL_SUCCESS) {
+	status = CL_INVALID_EVENT_WAIT_LIST;
+      }
+      if(status <= CL_COMPLETE) {
+	complete_launch(launch, status, now_ns());
+      }
+    }
+    if(!__atomic_load_n(&launch->completed, __ATOMIC_ACQUIRE)) {
+      link = &launch->next;
+      continue;
+    }
+    struct tenant *tenant = launch->tenant;
+    cl_int status = launch->status;
+    uint64_t kernel_ns;
+    if(!kernel_time_ns(launch, &kernel_ns)) {
+      ++tenant->estimated;
+    }
+    tenant->kernel_ns += kernel_ns;
+    tenant->virtual_time += kernel_ns / tenant->weight;
+    --tenant->num_in_flight;
+    if(status == CL_COMPLETE) {
+      ++tenant->completed;
+    }
+    else {
+      WARN("Launch of a kernel for tenant %s failed: 0x%x",
+	   tenant->name, status);
+      ++tenant->failed;
+    }
+    uint64_t latency = launch->completed_ns - launch->submitted_ns;
+    uint64_t bound = 1000;
+    int bucket = 0;
+    while(bucket < LATENCY_BUCKETS && latency > bound) {
+      bound <<= 1;
+      ++bucket;
+    }
+    tenant->latency_ns += latency;
+    ++tenant->latency[bucket];
+    *link = launch->next;
+    free_launch(launch);
+  }
+}
+
+static struct tenant *
+next_tenant() {
+  struct tenant *chosen = NULL;
+  for(struct tenant *tenant = tenants; tenant; tenant = tenant->next) {
+    if(tenant->num_pending == 0) {
+      continue;
+    }
+    if(tenant->num_in_flight >= tenant->max_in_flight) {
+      if(!tenant->pending->deferred) {
+	tenant->pending->deferred = 1;
+	++tenant->deferred;
+      }
+      continue;
+    }
+    if(chosen == NULL
+       || tenant->priority > chosen->priority
+       || (tenant->priority == chosen->priority
+	   && tenant->virtual_time < chosen->virtual_time)) {
+      chosen = tenant;
+    }
+  }
+  return chosen;
+}
+
+static cl_int
+dispatch_launch(struct scheduled_launch *launch) {
+  cl_int result;
+  for(int i = 0; i < launch->num_arguments; ++i) {
+    struct kernel_argument *argument = &launch->arguments[i];
+    result = clSetKernelArg(launch->kernel, i, argument->size,
+			    argument->value ? argument->data : NULL);
+    if(result != CL_SUCCESS) {
+      return result;
+    }
+  }
+  uint64_t start = now_ns();
+  result = clEnqueueNDRangeKernel(launch->queue, launch->kernel,
+				  launch->dims, NULL,
+				  launch->global_work_size,
+				  launch->has_local_work_size
+				  ? launch->local_work_size
+				  : NULL,
+				  0, NULL, &launch->event);
+  count_enqueue(ENQUEUE_KERNEL, start);
+  if(result == CL_SUCCESS) {
+    launch->enqueued_ns = now_ns();
+    launch->clock = find_queue_clock(launch->queue);
+    // the completion is timed when it happens rather than when the
+    // scheduler gets to notice it
+    launch->has_callback
+      = clSetEventCallback(launch->event, CL_COMPLETE, on_launch_complete,
+			   launch) == CL_SUCCESS;
+    __atomic_fetch_add(&launch->counters->launches, 1, __ATOMIC_RELAXED);
+    clFlush(launch->queue);
+    if(CAPTURING) {
+      struct trace_buffer payload = { NULL, 0, 0 };
+      trace_put_u64(&payload, TRACE_ID(launch->kernel));
+      trace_put_u64(&payload, TRACE_ID(launch->program));
+      trace_put_string(&payload, launch->counters->name);
+      capture(TRACE_KERNEL, start, &payload);
+      capture_bind(launch->kernel, launch->num_arguments, launch->arguments,
+		   start);
+      capture_launch(launch->queue, launch->kernel, launch->dims,
+		     launch->global_work_size,
+		     launch->has_local_work_size
+		     ? launch->local_work_size
+		     : NULL,
+		     start);
+    }
+  }
+  else {
+    launch->event = NULL;
+  }
+  return result;
+}
+
+// must be called with the scheduler_mutex held
+static void
+schedule() {
+  retire_launches();
+  struct tenant *tenant;
+  while((tenant = next_tenant()) != NULL) {
+    struct scheduled_launch *launch = tenant->pending;
+    tenant->pending = launch->next;
+    if(tenant->pending == NULL) {
+      tenant->last_pending = NULL;
+    }
+    --tenant->num_pending;
+    cl_int result = dispatch_launch(launch);
+    if(result != CL_SUCCESS) {
+      WARN_("Failed to enqueue a kernel for tenant %s: ", tenant->name);
+      cl_warn(result);
+      ++tenant->failed;
+      free_launch(launch);
+      continue;
+    }
+    ++tenant->admitted;
+    ++tenant->num_in_flight;
+    launch->next = launches_in_flight;
+    launches_in_flight = launch;
+  }
+  for(struct tenant **t = &tenants; *t; ) {
+    tenant = *t;
+    if(__atomic_load_n(&tenant->collected, __ATOMIC_ACQUIRE)
+       && tenant->num_pending == 0 && tenant->num_in_flight == 0) {
+      *t = tenant->next;
+      free(tenant->name);
+      free(tenant);
+    }
+    else {
+      t = &tenant->next;
+    }
+  }
+}
+
+static int
+parse_work_size(SCM s_dims, size_t *work_size) {
+  if(scm_is_pair(s_dims)) {
+    int dims = scm_to_int(scm_length(s_dims));
+    assert(0 < dims && dims <= 3);
+    for(int i = 0; scm_is_pair(s_dims); ++i, s_dims = scm_cdr(s_dims)) {
+      work_size[i] = scm_to_size_t(scm_car(s_dims));
+    }
+    return dims;
+  }
+  work_size[0] = scm_to_size_t(s_dims);
+  return 1;
+}
+
+static SCM
+submit_kernel_x(SCM s_tenant, SCM s_queue, SCM s_kernel, SCM s_arguments,
+		SCM s_dims, SCM s_local_dims) {
+  scm_assert_smob_type(cl_tenant_tag, s_tenant);
+  scm_assert_smob_type(cl_command_queue_tag, s_queue);
+  scm_assert_smob_type(cl_kernel_tag, s_kernel);
+  struct tenant *tenant = (struct tenant *) SCM_SMOB_DATA(s_tenant);
+  struct scheduled_launch *launch
+    = calloc(1, sizeof(struct scheduled_launch));
+  launch->tenant = tenant;
+  launch->queue = (cl_command_queue) SCM_SMOB_DATA(s_queue);
+  launch->counters = KERNEL_COUNTERS(s_kernel);
+  // the launch sets its arguments on a kernel of its own, so that
+  // the caller's kernel keeps the arguments bound to it
+  char *name = (char *) SCM_SMOB_DATA_2(s_kernel);
+  cl_int result = clGetKernelInfo((cl_kernel) SCM_SMOB_DATA(s_kernel),
+				  CL_KERNEL_PROGRAM, sizeof(cl_program),
+				  &launch->program, NULL);
+  if(result == CL_SUCCESS) {
+    launch->kernel = clCreateKernel(launch->program, name, &result);
+  }
+  if(result != CL_SUCCESS) {
+    WARN("Failed to create kernel %s for tenant %s: 0x%x",
+	 name, tenant->name, result);
+    free(launch);
+    return SCM_BOOL_F;
+  }
+  launch->dims = parse_work_size(s_dims, launch->global_work_size);
+  if(!SCM_UNBNDP(s_local_dims)) {
+    int local_dims = parse_work_size(s_local_dims, launch->local_work_size);
+    assert(local_dims == launch->dims);
+    launch->has_local_work_size = 1;
+  }
+
+  // the arguments are captured now, because the kernel
+  // may be bound to other arguments before it is enqueued
+  launch->num_arguments = scm_to_int(scm_length(s_arguments));
+  launch->arguments
+    = calloc(launch->num_arguments, sizeof(struct kernel_argument));
+  launch->buffers = calloc(launch->num_arguments, sizeof(cl_mem));
+  for(int i = 0;
+      scm_is_pair(s_arguments);
+      ++i, s_arguments = scm_cdr(s_arguments)) {
+    SCM argument = scm_car(s_arguments);
+    if(!kernel_argument(argument, &launch->arguments[i])) {
+      WARN("Unrecognized argument type for argument %d to kernel %s",
+	   i, name);
+      for(int j = 0; j < launch->num_buffers; ++j) {
+	clReleaseMemObject(launch->buffers[j]);
+      }
+      clReleaseKernel(launch->kernel);
+      free(launch->buffers);
+      free(launch->arguments);
+      free(launch);
+      return SCM_BOOL_F;
+    }
+    if(SCM_SMOB_PREDICATE(cl_buffer_tag, argument)) {
+      launch->buffers[launch->num_buffers] = (cl_mem) SCM_SMOB_DATA(argument);
+      clRetainMemObject(launch->buffers[launch->num_buffers++]);
+    }
+  }
+  clRetainCommandQueue(launch->queue);
+  launch->submitted_ns = now_ns();
+
+  pthread_mutex_lock(&scheduler_mutex);
+  ++tenant->submitted;
+  if(tenant->num_pending >= tenant->max_pending) {
+    ++tenant->rejected;
+    schedule();
+    pthread_mutex_unlock(&scheduler_mutex);
+    free_launch(launch);
+    return SCM_BOOL_F;
+  }
+  if(tenant->num_pending == 0 && tenant->num_in_flight == 0) {
+    // a tenant that was idle doesn't get credit for the time when
+    // it wasn't using the device, so it starts where the least served
+    // of the active tenants of its priority is
+    struct tenant *least_served = NULL;
+    for(struct tenant *t = tenants; t; t = t->next) {
+      if(t != tenant && t->priority == tenant->priority
+	 && (t->num_pending > 0 || t->num_in_flight > 0)
+	 && (least_served == NULL
+	     || t->virtual_time < least_served->virtual_time)) {
+	least_served = t;
+      }
+    }
+    if(least_served && least_served->virtual_time > tenant->virtual_time) {
+      tenant->virtual_time = least_served->virtual_time;
+    }
+  }
+  if(tenant->last_pending) {
+    tenant->last_pending->next = launch;
+  }
+  else {
+    tenant->pending = launch;
+  }
+  tenant->last_pending = launch;
+  ++tenant->num_pending;
+  schedule();
+  pthread_mutex_unlock(&scheduler_mutex);
+  return SCM_BOOL_T;
+}
+
+static SCM
+schedule_x() {
+  int queued = 0;
+  pthread_mutex_lock(&scheduler_mutex);
+  schedule();
+  for(struct tenant *tenant = tenants; tenant; tenant = tenant->next) {
+    queued += tenant->num_pending + tenant->num_in_flight;
+  }
+  pthread_mutex_unlock(&scheduler_mutex);
+  return scm_from_int(queued);
+}
+
+static SCM
+scheduler_finish_x() {
+  while(1) {
+    pthread_mutex_lock(&scheduler_mutex);
+    schedule();
+    cl_event event = NULL;
+    if(launches_in_flight) {
+      event = launches_in_flight->event;
+      clRetainEvent(event);
+    }
+    pthread_mutex_unlock(&scheduler_mutex);
+    if(event == NULL) {
+      // nothing is in flight, so nothing can be pending either
+      break;
+    }
+    clWaitForEvents(1, &event);
+    clReleaseEvent(event);
+  }
+  return SCM_UNSPECIFIED;
+}
+
+// waits only for the launches of one tenant, so that an interactive
+// tenant doesn't have to wait for the backlogs of the others
+static SCM
+tenant_finish_x(SCM s_tenant) {
+  scm_assert_smob_type(cl_tenant_tag, s_tenant);
+  struct tenant *tenant = (struct tenant *) SCM_SMOB_DATA(s_tenant);
+  while(1) {
+    pthread_mutex_lock(&scheduler_mutex);
+    schedule();
+    cl_event event = NULL;
+    for(struct scheduled_launch *launch = launches_in_flight; launch;
+	launch = launch->next) {
+      if(launch->tenant == tenant) {
+	event = launch->event;
+	clRetainEvent(event);
+	break;
+      }
+    }
+    pthread_mutex_unlock(&scheduler_mutex);
+    if(event == NULL) {
+      // a tenant with pending launches always has some in flight
+      break;
+    }
+    clWaitForEvents(1, &event);
+    clReleaseEvent(event);
+  }
+  return SCM_UNSPECIFIED;
+}
+
+static SCM
+latency_quantile(const uint64_t *latency, uint64_t count, double q) {
+  // the upper bound of the bucket that contains the quantile
+  uint64_t rank = (uint64_t) (q * count + 0.5);
+  uint64_t cumulative = 0;
+  for(int i = 0; i < LATENCY_BUCKETS; ++i) {
+    cumulative += latency[i];
+    if(cumulative >= rank) {
+      return scm_from_double((1 << i) * 1e-6);
+    }
+  }
+  return scm_from_latin1_symbol("+inf");
+}
+
+static SCM
+tenant_stats(SCM s_tenant) {
+  scm_assert_smob_type(cl_tenant_tag, s_tenant);
+  struct tenant *tenant = (struct tenant *) SCM_SMOB_DATA(s_tenant);
+  pthread_mutex_lock(&scheduler_mutex);
+  schedule();
+  struct tenant t = *tenant;
+  pthread_mutex_unlock(&scheduler_mutex);
+
+  uint64_t count = 0;
+  for(int i = 0; i <= LATENCY_BUCKETS; ++i) {
+    count += t.latency[i];
+  }
+  SCM stats = SCM_EOL;
+  if(count > 0) {
+    stats = scm_acons(scm_from_latin1_symbol("latency-p99"),
+		      latency_quantile(t.latency, count, 0.99), stats);
+    stats = scm_acons(scm_from_latin1_symbol("latency-p50"),
+		      latency_quantile(t.latency, count, 0.5), stats);
+    stats = scm_acons(scm_from_latin1_symbol("mean-latency"),
+		      scm_from_double(t.latency_ns * 1e-9 / count), stats);
+  }
+  stats = scm_acons(scm_from_latin1_symbol("kernel-seconds"),
+		    scm_from_double(t.kernel_ns * 1e-9), stats);
+  // the kernel seconds of these launches are estimates,
+  // because their queues weren't created with profiling
+  stats = scm_acons(scm_from_latin1_symbol("estimated-launches"),
+		    scm_from_uint64(t.estimated), stats);
+  stats = scm_acons(scm_from_latin1_symbol("in-flight"),
+		    scm_from_int(t.num_in_flight), stats);
+  stats = scm_acons(scm_from_latin1_symbol("pending"),
+		    scm_from_int(t.num_pending), stats);
+  stats = scm_acons(scm_from_latin1_symbol("failed"),
+		    scm_from_uint64(t.failed), stats);
+  stats = scm_acons(scm_from_latin1_symbol("completed"),
+		    scm_from_uint64(t.completed), stats);
+  stats = scm_acons(scm_from_latin1_symbol("deferred"),
+		    scm_from_uint64(t.deferred), stats);
+  stats = scm_acons(scm_from_latin1_symbol("rejected"),
+		    scm_from_uint64(t.rejected), stats);
+  stats = scm_acons(scm_from_latin1_symbol("admitted"),
+		    scm_from_uint64(t.admitted), stats);
+  stats = scm_acons(scm_from_latin1_symbol("submitted"),
+		    scm_from_uint64(t.submitted), stats);
+  return stats;
+}
+
 static SCM
 finish_queue_x(SCM s_queue) {
   scm_assert_smob_type(cl_command_queue_tag, s_queue);
-  clFinish((cl_command_queue) SCM_SMOB_DATA(s_queue));
+  cl_command_queue queue = (cl_command_queue) SCM_SMOB_DATA(s_queue);
+  // the scheduler dispatches what it can before the queue is
+  // drained, and retires the launches that completed after
+  pthread_mutex_lock(&scheduler_mutex);
+  schedule();
+  pthread_mutex_unlock(&scheduler_mutex);
+  uint64_t start = now_ns();
+  clFinish(queue);
+  pthread_mutex_lock(&scheduler_mutex);
+  schedule();
+  pthread_mutex_unlock(&scheduler_mutex);
+  if(CAPTURING) {
+    struct trace_buffer payload = { NULL, 0, 0 };
+    trace_put_u64(&payload, TRACE_ID(queue));
+    capture(TRACE_FINISH, start, &payload);
+  }
   return SCM_UNSPECIFIED;
 }
 
@@ -775,15 +3216,34 @@ init() {
   cl_image2d_tag = scm_make_smob_type("OpenCL 2D image", 0);
   cl_image3d_tag = scm_make_smob_type("OpenCL 3D image", 0);
   cl_event_tag = scm_make_smob_type("OpenCL event", 0);
+  cl_staging_pool_tag = scm_make_smob_type("OpenCL staging pool", 0);
+  cl_tenant_tag = scm_make_smob_type("OpenCL tenant", 0);
   
+  device_info_cache = scm_permanent_object(scm_c_make_hash_table(31));
+  buffer_placement
+    = scm_permanent_object(scm_make_weak_key_hash_table(scm_from_int(256)));
+  kernel_arguments
+    = scm_permanent_object(scm_make_weak_key_hash_table(scm_from_int(31)));
+
   scm_set_smob_print(cl_platform_tag, platform_smob_print);
   scm_set_smob_print(cl_device_tag, device_smob_print);
 
+  scm_set_smob_print(cl_command_queue_tag, queue_smob_print);
+
   scm_set_smob_print(cl_kernel_tag, kernel_smob_print);
   scm_set_smob_free(cl_kernel_tag, kernel_smob_free);
+
+  scm_set_smob_free(cl_buffer_tag, buffer_smob_free);
+
+  scm_set_smob_free(cl_staging_pool_tag, staging_pool_smob_free);
+
+  scm_set_smob_print(cl_tenant_tag, tenant_smob_print);
+  scm_set_smob_free(cl_tenant_tag, tenant_smob_free);
   
   scm_c_define_gsubr("cl-platforms", 0, 0, 0, platforms);
   scm_c_define_gsubr("cl-devices", 1, 0, 1, devices);
+  scm_c_define_gsubr("cl-platform-info", 1, 1, 0, platform_info);
+  scm_c_define_gsubr("cl-device-info", 1, 1, 0, device_info);
   scm_c_define_gsubr("cl-make-context", 0, 0, 1, create_context);
   scm_c_define_gsubr("call-with-cl-context", 2, 0, 0,
 		     call_with_context);
@@ -792,15 +3252,46 @@ init() {
 
   scm_c_define_gsubr("cl-make-command-queue", 1, 0, 1,
 		     create_command_queue);
+  scm_c_define_gsubr("cl-queue-id", 1, 0, 0, queue_id);
   scm_c_define_gsubr("cl-make-program", 1, 0, 1, create_program);
   scm_c_define_gsubr("call-with-cl-build-options", 2, 0, 0,
 		     call_with_build_options);
+  scm_c_define_gsubr("cl-program-info", 1, 2, 0, program_info);
   scm_c_define_gsubr("cl-kernel", 2, 0, 0, kernel);
+  scm_c_define_gsubr("cl-kernel-work-group-info", 1, 2, 0,
+		     kernel_work_group_info);
   scm_c_define_gsubr("cl-make-buffer", 1, 0, 1, create_buffer);
   scm_c_define_gsubr("cl-bind-arguments", 1, 0, 1, bind_arguments);
   scm_c_define_gsubr("cl-enqueue-read-buffer!", 2, 2, 0, enqueue_read_buffer_x);
   scm_c_define_gsubr("cl-enqueue-write-buffer!", 2, 2, 0, enqueue_write_buffer_x);
+  scm_c_define_gsubr("cl-enqueue-copy-buffer!", 3, 3, 0,
+		     enqueue_copy_buffer_x);
   scm_c_define_gsubr("cl-enqueue-kernel!", 3, 1, 0, enqueue_kernel_x);
+  scm_c_define_gsubr("cl-enqueue-migrate-buffers!", 2, 0, 1,
+		     enqueue_migrate_buffers_x);
+  scm_c_define_gsubr("cl-set-buffer-placement!", 2, 0, 1,
+		     set_buffer_placement_x);
+  scm_c_define_gsubr("cl-buffer-placement", 1, 0, 0, buffer_placement_hint);
+  scm_c_define_gsubr("cl-prefetch-buffers!", 1, 0, 0, prefetch_buffers_x);
+  scm_c_define_gsubr("cl-migration-stats", 0, 0, 0, get_migration_stats);
+
+  scm_c_define_gsubr("cl-make-staging-pool", 1, 2, 0, create_staging_pool);
+  scm_c_define_gsubr("call-with-cl-staging-pool", 2, 0, 0,
+		     call_with_staging_pool);
+  scm_c_define_gsubr("cl-staging-pool-stats", 1, 0, 0, staging_pool_stats);
+
+  scm_c_define_gsubr("cl-make-tenant", 1, 4, 0, create_tenant);
+  scm_c_define_gsubr("cl-submit-kernel!", 5, 1, 0, submit_kernel_x);
+  scm_c_define_gsubr("cl-schedule!", 0, 0, 0, schedule_x);
+  scm_c_define_gsubr("cl-scheduler-finish!", 0, 0, 0, scheduler_finish_x);
+  scm_c_define_gsubr("cl-tenant-finish!", 1, 0, 0, tenant_finish_x);
+  scm_c_define_gsubr("cl-tenant-stats", 1, 0, 0, tenant_stats);
+
+  scm_c_define_gsubr("cl-counters", 0, 0, 0, get_counters);
+  scm_c_define_gsubr("cl-dump-counters", 1, 0, 0, dump_counters);
+
+  scm_c_define_gsubr("cl-start-capture!", 1, 1, 0, start_capture_x);
+  scm_c_define_gsubr("cl-stop-capture!", 0, 0, 0, stop_capture_x);
 
   scm_c_define_gsubr("cl-finish!", 1, 0, 0, finish_queue_x);
 }